@@ -14,6 +14,7 @@ static const struct {
 	{"ALT + c-P", "Cycle focus to previous window"},
 	{"ALT + c-A", "Unfocus all window"},
 	{"ALT + c-B", "Toggle window border"},
+	{"ALT + c-S", "Toggle counters in the statusbar"},
 	{"CTRL + /", "Shutdown the system"}
 };
 
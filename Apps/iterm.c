@@ -1,3 +1,5 @@
+#define _GNU_SOURCE		/* memmem */
+
 #include "../cosh.h"
 #include "../wmcurses.h"
 
@@ -14,10 +16,48 @@
 #include <vterm.h>
 #include <utmp.h>
 #include <pty.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "../Core/ring.h"
+#include "../Core/hist.h"
+#include "../Core/find.h"
 
-#define HIST_SIZE	1024
 #define READ_BUF_SIZE	16384
+#define RING_SIZE	(1 << 20)	/* threaded I/O backlog per terminal */
 #define MAX_CELL_CHARS	6
+#define HANGUP_GRACE_MS	500	/* SIGHUP to SIGKILL */
+#define TX_CHUNK	4096	/* pty output queue granularity */
+#define TX_IOV		64	/* chunks per writev */
+#define DAMAGE_MAX	16	/* rects kept before they collapse into one */
+#define CELL_WIDE_CONT	((uint32_t)-1)	/* right half of a wide character */
+#define CELL_RGB	0x1000000	/* colour holds 0xRRGGBB */
+#define FIND_MAX	48	/* code points of a search */
+
+#ifdef NCURSES_VERSION
+/* ncurses cchar_t is a plain struct, patch the glyph of a copied template */
+#define CCHAR_SET_ASCII(cc, ch, a, pair)	((cc)->chars[0] = (wchar_t)(ch))
+#else
+#define CCHAR_SET_ASCII(cc, ch, a, pair) \
+	win_setcchar((cc), (const wchar_t[]){ (wchar_t)(ch), L'\0' }, (a), \
+		     (pair))
+#endif
+
+/* [terminal] threaded_io */
+#define ITERM_IO_INLINE	0	/* read and parse on the main thread */
+#define ITERM_IO_READER	1	/* reader thread, parse on the main thread */
+#define ITERM_IO_PARSER	2	/* reader thread parses, main renders snapshots */
+
+/* Parser side effects, applied to the window on the main thread */
+#define ITERM_EV_DIRTY		0x01
+#define ITERM_EV_PUSHLINE	0x02
+#define ITERM_EV_ALT_ON		0x04
+#define ITERM_EV_ALT_OFF	0x08
+#define ITERM_EV_HIST_CLEAR	0x10
+#define ITERM_EV_TITLE		0x20
+#define ITERM_EV_TX		0x40
 
 /* Terminal cell representation for history buffer. */
 typedef struct {
@@ -26,12 +66,88 @@ typedef struct {
 	VTermScreenCellAttrs attrs;
 } iterm_cell_t;
 
+/**
+ * iterm_hcell_t - Scrollback cell, a quarter of an iterm_cell_t
+ * Cells that hold more than one code point or an RGB colour are kept
+ * whole in the line's side table, @ch is then their index in it.
+ */
+typedef struct {
+	uint32_t ch;		/* code point, CELL_WIDE_CONT or ext index */
+	uint8_t fg, bg;		/* palette index unless HCELL_*_DEFAULT */
+	uint16_t attr;		/* HCELL_* */
+} iterm_hcell_t;
+
+#define HCELL_BOLD		0x0001
+#define HCELL_UNDERLINE		0x0006	/* two bits of underline style */
+#define HCELL_ITALIC		0x0008
+#define HCELL_BLINK		0x0010
+#define HCELL_REVERSE		0x0020
+#define HCELL_CONCEAL		0x0040
+#define HCELL_STRIKE		0x0080
+#define HCELL_FG_DEFAULT	0x0100
+#define HCELL_BG_DEFAULT	0x0200
+#define HCELL_EXT		0x0400	/* the cell is ext[ch] */
+
+/* A scrollback record: the cells, then the side table */
 typedef struct {
-	iterm_cell_t *cells;
 	int cols;
+	int n_ext;
+	iterm_hcell_t cells[];
 } iterm_line_t;
 
+static inline iterm_cell_t *line_ext(const iterm_line_t *line)
+{
+	return (iterm_cell_t *) (line->cells + line->cols);
+}
+
+/* Bytes queued for the shell */
+typedef struct iterm_chunk {
+	struct iterm_chunk *next;
+	size_t off, len;
+	char data[TX_CHUNK];
+} iterm_chunk_t;
+
+/* Screen regions that changed since the last render */
+typedef struct {
+	VTermRect rect[DAMAGE_MAX];
+	int count;
+} iterm_damage_t;
+
+/* Whole lines moved by moverect, not yet scrolled in the window */
+typedef struct {
+	int top, bottom;	/* screen rows [top, bottom) */
+	int n;			/* lines up, negative is down, 0 is none */
+} iterm_scroll_t;
+
+/**
+ * iterm_find_t - Scrollback search
+ * Lines are numbered by iterm_t.hist_seq, so a match keeps its number
+ * while newer lines push it back.
+ */
+typedef struct {
+	int active;
+	uint32_t needle[FIND_MAX];
+	int len;
+	int fold;		/* no capital typed, ignore ASCII case */
+	uint64_t keys[FIND_KEYS];	/* needle trigrams for the index */
+	int nkeys;
+	int64_t origin;		/* searching starts at this line */
+	int found;
+	uint64_t line;		/* current match, cells [col, end) */
+	int col, end;
+	char title[64];		/* window title to restore */
+} iterm_find_t;
+
+/* Immutable copy of the screen published by the parser thread */
+typedef struct {
+	iterm_cell_t *cells;
+	int rows, cols;
+	VTermPos cursor;
+	int altscreen;
+} iterm_snap_t;
+
 typedef struct {
+	cosh_win_t *win;	/* main thread only */
 	VTerm *vt;
 	VTermScreen *vts;
 	int fd;
@@ -40,11 +156,60 @@ typedef struct {
 	int is_altscreen;
 	int is_mouse_mode;
 
-	iterm_line_t *history;
-	int hist_head;
-	int hist_cnt;
-
-	int pairs[256][256];
+	c_hist_t hist;		/* iterm_line_t records */
+	uint64_t hist_seq;	/* lines pushed since the last clear */
+	c_find_idx_t find_idx;	/* trigrams of every history line */
+	iterm_find_t find;	/* main thread, read under the vt lock */
+
+	/* history line text, vt lock */
+	uint32_t *find_text;
+	int *find_col;		/* cell each code point starts at */
+	int find_cap;
+
+	/* keyboard and vterm replies, flushed by one writev per loop run */
+	iterm_chunk_t *tx_head, *tx_tail;
+	size_t tx_bytes;
+	int tx_fd;		/* dup of fd, watched for EPOLLOUT when full */
+	c_watch_t *tx_watch;
+	int tx_blocked;
+	int tx_lost;		/* bytes dropped for want of memory */
+
+	int events;		/* ITERM_EV_*, posted by the parser */
+	char title[64];
+
+	/* guards vt and history while the parser runs on its own thread */
+	pthread_mutex_t vt_lock;
+
+	/* ITERM_IO_PARSER: double buffered screen snapshot */
+	iterm_snap_t snap[2];
+	int snap_front;
+	pthread_mutex_t snap_lock;	/* held while the front is read or swapped */
+	unsigned char *snap_stale;	/* rows the back buffer is missing */
+	int dmg_lo, dmg_hi;	/* rows damaged since the last publish */
+
+	/* cells to repaint, published along with the snapshot in PARSER mode */
+	iterm_damage_t damage;	/* vt lock */
+	iterm_damage_t damage_ready;	/* snap lock */
+	iterm_scroll_t scroll;	/* vt lock, damage above is after it */
+	iterm_scroll_t scroll_ready;	/* snap lock */
+	VTermPos cur_drawn;	/* cell last painted as the cursor, row -1 none */
+
+	/* threaded I/O: reader thread -> rx -> main thread */
+	int io_mode;
+	int threaded;
+	pthread_t reader;
+	c_ring_t rx;
+	int notify_fd;		/* eventfd, reader -> event loop */
+	int wake_fd;		/* eventfd, main -> reader (space / stop) */
+	int armed;		/* consumer ran dry, wants a notify */
+	int starved;		/* producer is waiting for space */
+	int stop;
+	int eof;
+
+	/* row blitter scratch, grown to the widest row drawn */
+	cchar_t *blit;
+	iterm_cell_t *row_cells;
+	int blit_cap;
 } iterm_t;
 
 static const struct {
@@ -68,269 +233,1465 @@ static const struct {
 
 /*  Internal Helpers  */
 
-static inline int get_color_idx(VTermColor c)
+/* cell colours: -1 default, 0..255 palette, CELL_RGB | 0xRRGGBB */
+static inline int get_color_idx(VTermColor c)
+{
+	if (c.type & VTERM_COLOR_DEFAULT_MASK)
+		return -1;
+	if (VTERM_COLOR_IS_INDEXED(&c))
+		return c.indexed.idx;
+	return CELL_RGB | (c.rgb.red << 16) | (c.rgb.green << 8) | c.rgb.blue;
+}
+
+static inline int cell_color(int v, int dflt)
+{
+	if (v < 0)
+		return dflt;
+	if (v & CELL_RGB)
+		return win_color_rgb((v >> 16) & 0xff, (v >> 8) & 0xff,
+				     v & 0xff);
+	return win_color_index(v);
+}
+
+static int get_pair(iterm_t *self, int vfg, int vbg)
+{
+	/* vterm's default colours are the window's own */
+	return win_pair(cell_color(vfg, self->win->fg),
+			cell_color(vbg, self->win->bg));
+}
+
+/*  History Management  */
+
+static inline int color_is_rgb(int v)
+{
+	return v >= 0 && (v & CELL_RGB);
+}
+
+/* what an iterm_hcell_t cannot hold */
+static inline int hcell_needs_ext(const iterm_cell_t *c)
+{
+	return (c->chars[0] != CELL_WIDE_CONT && c->chars[0] && c->chars[1]) ||
+	    color_is_rgb(c->fg) || color_is_rgb(c->bg);
+}
+
+static void hcell_pack(iterm_hcell_t *dst, const iterm_cell_t *src)
+{
+	uint16_t a = 0;
+
+	if (src->attrs.bold)
+		a |= HCELL_BOLD;
+	a |= (uint16_t)(src->attrs.underline << 1) & HCELL_UNDERLINE;
+	if (src->attrs.italic)
+		a |= HCELL_ITALIC;
+	if (src->attrs.blink)
+		a |= HCELL_BLINK;
+	if (src->attrs.reverse)
+		a |= HCELL_REVERSE;
+	if (src->attrs.conceal)
+		a |= HCELL_CONCEAL;
+	if (src->attrs.strike)
+		a |= HCELL_STRIKE;
+	if (src->fg < 0)
+		a |= HCELL_FG_DEFAULT;
+	if (src->bg < 0)
+		a |= HCELL_BG_DEFAULT;
+
+	dst->ch = src->chars[0];
+	dst->fg = (uint8_t)src->fg;
+	dst->bg = (uint8_t)src->bg;
+	dst->attr = a;
+}
+
+static void hcell_unpack(iterm_cell_t *dst, const iterm_line_t *line, int i)
+{
+	const iterm_hcell_t *h = &line->cells[i];
+
+	if (h->attr & HCELL_EXT) {
+		*dst = line_ext(line)[h->ch];
+		return;
+	}
+
+	memset(dst, 0, sizeof(*dst));
+	dst->chars[0] = h->ch;
+	dst->fg = (h->attr & HCELL_FG_DEFAULT) ? -1 : h->fg;
+	dst->bg = (h->attr & HCELL_BG_DEFAULT) ? -1 : h->bg;
+	dst->attrs.bold = !!(h->attr & HCELL_BOLD);
+	dst->attrs.underline = (h->attr & HCELL_UNDERLINE) >> 1;
+	dst->attrs.italic = !!(h->attr & HCELL_ITALIC);
+	dst->attrs.blink = !!(h->attr & HCELL_BLINK);
+	dst->attrs.reverse = !!(h->attr & HCELL_REVERSE);
+	dst->attrs.conceal = !!(h->attr & HCELL_CONCEAL);
+	dst->attrs.strike = !!(h->attr & HCELL_STRIKE);
+}
+
+static inline void iterm_post(iterm_t *self, int ev)
+{
+	__atomic_fetch_or(&self->events, ev, __ATOMIC_SEQ_CST);
+}
+
+static inline void iterm_lock(iterm_t *self)
+{
+	if (self->io_mode == ITERM_IO_PARSER)
+		pthread_mutex_lock(&self->vt_lock);
+}
+
+static inline void iterm_unlock(iterm_t *self)
+{
+	if (self->io_mode == ITERM_IO_PARSER)
+		pthread_mutex_unlock(&self->vt_lock);
+}
+
+static void cell_pack(iterm_cell_t *dst, const VTermScreenCell *src)
+{
+	memcpy(dst->chars, src->chars, sizeof(uint32_t) * MAX_CELL_CHARS);
+	dst->fg = get_color_idx(src->fg);
+	dst->bg = get_color_idx(src->bg);
+	dst->attrs = src->attrs;
+}
+
+static void clear_history(iterm_t *self)
+{
+	c_hist_reset(&self->hist);
+	c_find_idx_reset(&self->find_idx);
+	self->hist_seq = 0;
+}
+
+/**
+ * line_text - Code points of a history line into find_text/find_col
+ * Blank cells read as spaces, the right halves of wide characters are
+ * left out. Returns the count, -1 when out of memory.
+ */
+static int line_text(iterm_t *self, const iterm_line_t *l, int fold)
+{
+	const iterm_cell_t *ext = line_ext(l);
+	int n = 0;
+
+	if (l->cols > self->find_cap) {
+		uint32_t *text = realloc(self->find_text,
+					 sizeof(uint32_t) * l->cols);
+		int *col;
+
+		if (!text)
+			return -1;
+		self->find_text = text;
+
+		col = realloc(self->find_col, sizeof(int) * l->cols);
+		if (!col)
+			return -1;
+		self->find_col = col;
+		self->find_cap = l->cols;
+	}
+
+	for (int i = 0; i < l->cols; i++) {
+		const iterm_hcell_t *h = &l->cells[i];
+		uint32_t c = (h->attr & HCELL_EXT) ? ext[h->ch].chars[0] : h->ch;
+
+		if (c == CELL_WIDE_CONT)
+			continue;
+		if (c == 0)
+			c = ' ';
+
+		self->find_text[n] = fold ? c_find_fold(c) : c;
+		self->find_col[n++] = i;
+	}
+	return n;
+}
+
+static inline int rect_touches(const VTermRect *a, const VTermRect *b)
+{
+	return a->start_row <= b->end_row && b->start_row <= a->end_row &&
+	    a->start_col <= b->end_col && b->start_col <= a->end_col;
+}
+
+static inline void rect_union(VTermRect *dst, const VTermRect *src)
+{
+	if (src->start_row < dst->start_row)
+		dst->start_row = src->start_row;
+	if (src->start_col < dst->start_col)
+		dst->start_col = src->start_col;
+	if (src->end_row > dst->end_row)
+		dst->end_row = src->end_row;
+	if (src->end_col > dst->end_col)
+		dst->end_col = src->end_col;
+}
+
+/**
+ * damage_add - Record @rect, merging it into a rect it touches
+ * When the list is full everything collapses into the last rect.
+ */
+static void damage_add(iterm_damage_t *d, VTermRect rect)
+{
+	if (rect.start_row >= rect.end_row || rect.start_col >= rect.end_col)
+		return;
+
+	for (int i = 0; i < d->count; i++) {
+		if (rect_touches(&d->rect[i], &rect)) {
+			rect_union(&d->rect[i], &rect);
+			return;
+		}
+	}
+
+	if (d->count < DAMAGE_MAX) {
+		d->rect[d->count++] = rect;
+		return;
+	}
+
+	for (int i = 0; i < d->count - 1; i++)
+		rect_union(&d->rect[d->count - 1], &d->rect[i]);
+	d->rect[0] = d->rect[d->count - 1];
+	d->count = 1;
+	rect_union(&d->rect[0], &rect);
+}
+
+static void damage_take(iterm_damage_t *dst, iterm_damage_t *src)
+{
+	for (int i = 0; i < src->count; i++)
+		damage_add(dst, src->rect[i]);
+	src->count = 0;
+}
+
+/**
+ * damage_shift - Move the damage inside rows [@top, @bottom) up by @n
+ * What was painted there moves with a scroll, so does what was not.
+ * Rects reaching out of the region cover all of it instead.
+ */
+static void damage_shift(iterm_damage_t *d, int top, int bottom, int n)
+{
+	iterm_damage_t old = *d;
+
+	d->count = 0;
+	for (int i = 0; i < old.count; i++) {
+		VTermRect r = old.rect[i];
+
+		if (r.end_row <= top || r.start_row >= bottom) {
+			damage_add(d, r);
+			continue;
+		}
+
+		if (r.start_row < top || r.end_row > bottom) {
+			rect_union(&r, &(VTermRect) {
+				   .start_row = top,.end_row = bottom,
+				   .start_col = r.start_col,.end_col = r.end_col});
+			damage_add(d, r);
+			continue;
+		}
+
+		r.start_row = (r.start_row - n > top) ? r.start_row - n : top;
+		r.end_row = (r.end_row - n < bottom) ? r.end_row - n : bottom;
+		damage_add(d, r);
+	}
+}
+
+/**
+ * scroll_take - Fold @src and the damage @sd recorded after it into @dst
+ * @dd holds the damage recorded after @dst. Scrolls of the same region
+ * add up, a scroll of another region is given up and its rows damaged.
+ */
+static void scroll_take(iterm_scroll_t *dst, iterm_damage_t *dd,
+			iterm_scroll_t *src, iterm_damage_t *sd, int cols)
+{
+	if (src->n) {
+		if (!dst->n || (dst->top == src->top &&
+				dst->bottom == src->bottom)) {
+			damage_shift(dd, src->top, src->bottom, src->n);
+			dst->top = src->top;
+			dst->bottom = src->bottom;
+			dst->n += src->n;
+		} else {
+			damage_add(dd, (VTermRect) {
+				   .start_row = src->top,.end_row = src->bottom,
+				   .start_col = 0,.end_col = cols});
+		}
+		src->n = 0;
+	}
+
+	damage_take(dd, sd);
+}
+
+/*  Output queue, guarded by the vt lock  */
+
+static void tx_free(iterm_t *self)
+{
+	while (self->tx_head) {
+		iterm_chunk_t *c = self->tx_head;
+		self->tx_head = c->next;
+		free(c);
+	}
+	self->tx_tail = NULL;
+	self->tx_bytes = 0;
+}
+
+/**
+ * tx_append - Queue @len bytes for the shell
+ * Returns -1 and sets tx_lost if memory ran out, the rest of @buf is
+ * dropped.
+ */
+static int tx_append(iterm_t *self, const char *buf, size_t len)
+{
+	while (len > 0) {
+		iterm_chunk_t *c = self->tx_tail;
+		size_t n;
+
+		if (!c || c->len == TX_CHUNK) {
+			c = malloc(sizeof(iterm_chunk_t));
+			if (!c) {
+				c_log_error("Terminal output queue: %s",
+					    strerror(errno));
+				self->tx_lost = 1;
+				return -1;
+			}
+			c->next = NULL;
+			c->off = c->len = 0;
+			if (self->tx_tail)
+				self->tx_tail->next = c;
+			else
+				self->tx_head = c;
+			self->tx_tail = c;
+		}
+
+		n = TX_CHUNK - c->len;
+		if (n > len)
+			n = len;
+		memcpy(c->data + c->len, buf, n);
+		c->len += n;
+		self->tx_bytes += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * tx_flush - Write out the queue, wait for EPOLLOUT if the pty is full
+ */
+static void tx_flush(iterm_t *self)
+{
+	struct iovec iov[TX_IOV];
+
+	while (self->tx_head) {
+		iterm_chunk_t *c;
+		int n = 0;
+		ssize_t w;
+
+		for (c = self->tx_head; c && n < TX_IOV; c = c->next) {
+			iov[n].iov_base = c->data + c->off;
+			iov[n].iov_len = c->len - c->off;
+			n++;
+		}
+
+		w = writev(self->tx_fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!self->tx_blocked &&
+				    c_loop_mod(self->tx_watch,
+					       EPOLLOUT | EPOLLET) == 0)
+					self->tx_blocked = 1;
+				return;
+			}
+
+			/* the shell is gone, nobody will read it */
+			tx_free(self);
+			break;
+		}
+
+		self->tx_bytes -= (size_t)w;
+		while (w > 0) {
+			c = self->tx_head;
+			size_t left = c->len - c->off;
+
+			if ((size_t)w < left) {
+				c->off += (size_t)w;
+				break;
+			}
+
+			w -= (ssize_t)left;
+			self->tx_head = c->next;
+			if (!self->tx_head)
+				self->tx_tail = NULL;
+			free(c);
+		}
+	}
+
+	if (self->tx_blocked && c_loop_mod(self->tx_watch, EPOLLET) == 0)
+		self->tx_blocked = 0;
+}
+
+static int iterm_on_writable(c_watch_t *wt, uint32_t events)
+{
+	cosh_win_t *win = (cosh_win_t *) wt->data;
+	iterm_t *self = (iterm_t *) win->priv;
+	(void)events;
+
+	iterm_lock(self);
+	tx_flush(self);
+	iterm_unlock(self);
+	return LOOP_DONE;
+}
+
+/* flush on the next loop run, so one input pass becomes one writev */
+static void tx_kick(iterm_t *self)
+{
+	if (self->tx_head && !self->tx_blocked)
+		c_loop_kick(self->tx_watch);
+}
+
+static void cb_output(const char *s, size_t len, void *user)
+{
+	iterm_t *self = (iterm_t *) user;
+
+	tx_append(self, s, len);
+	iterm_post(self, ITERM_EV_TX);
+}
+
+/*
+ * Screen callbacks may run on the parser thread: they only touch the
+ * iterm_t and post ITERM_EV_* bits, iterm_apply() updates the window.
+ */
+static int cb_sb_pushline(int cols, const VTermScreenCell *cells, void *user)
+{
+	iterm_t *self = (iterm_t *) user;
+
+	if (!self || !self->hist.rec || self->is_altscreen)
+		return 1;
+
+	iterm_line_t *line;
+	iterm_cell_t cell, *ext;
+	int n_ext = 0, n;
+
+	for (int i = 0; i < cols; i++) {
+		cell_pack(&cell, &cells[i]);
+		n_ext += hcell_needs_ext(&cell);
+	}
+
+	/* the oldest lines make room, nothing is freed per line */
+	line = c_hist_push(&self->hist, sizeof(iterm_line_t) +
+			   sizeof(iterm_hcell_t) * cols +
+			   sizeof(iterm_cell_t) * n_ext);
+	if (!line)
+		return 0;
+
+	line->cols = cols;
+	line->n_ext = n_ext;
+	ext = line_ext(line);
+
+	n_ext = 0;
+	for (int i = 0; i < cols; i++) {
+		cell_pack(&cell, &cells[i]);
+		if (hcell_needs_ext(&cell)) {
+			ext[n_ext] = cell;
+			line->cells[i].ch = (uint32_t)n_ext++;
+			line->cells[i].attr = HCELL_EXT;
+		} else {
+			hcell_pack(&line->cells[i], &cell);
+		}
+	}
+
+	n = line_text(self, line, 0);
+	if (n > 0)
+		c_find_idx_add(&self->find_idx, self->hist_seq, self->find_text,
+			       n);
+	self->hist_seq++;
+	c_find_idx_trim(&self->find_idx,
+			self->hist_seq - c_hist_lines(&self->hist));
+
+	iterm_post(self, ITERM_EV_PUSHLINE);
+	return 1;
+}
+
+static int cb_movecursor(VTermPos pos, VTermPos oldpos, int visible, void *user)
+{
+	iterm_t *self = (iterm_t *) user;
+	(void)visible;
+
+	if (!self)
+		return 1;
+
+	/* the cursor is drawn as a colour, both cells change */
+	damage_add(&self->damage, (VTermRect) {
+		   .start_row = oldpos.row,.end_row = oldpos.row + 1,
+		   .start_col = oldpos.col,.end_col = oldpos.col + 1});
+	damage_add(&self->damage, (VTermRect) {
+		   .start_row = pos.row,.end_row = pos.row + 1,
+		   .start_col = pos.col,.end_col = pos.col + 1});
+	iterm_post(self, ITERM_EV_DIRTY);
+	return 1;
+}
+
+static int cb_damage(VTermRect rect, void *user)
+{
+	iterm_t *self = (iterm_t *) user;
+
+	if (!self)
+		return 1;
+
+	if (rect.start_row < self->dmg_lo)
+		self->dmg_lo = rect.start_row;
+	if (rect.end_row > self->dmg_hi)
+		self->dmg_hi = rect.end_row;
+	damage_add(&self->damage, rect);
+
+	iterm_post(self, ITERM_EV_DIRTY);
+	return 1;
+}
+
+/**
+ * cb_moverect - Keep whole-line scrolls, the window scrolls them with wscrl
+ * Damage recorded before the move is moved along with it. Anything else
+ * is refused and vterm damages @dest instead.
+ */
+static int cb_moverect(VTermRect dest, VTermRect src, void *user)
+{
+	iterm_t *self = (iterm_t *) user;
+	iterm_scroll_t *sc;
+	int rows, cols, top, bottom, n;
+
+	if (!self)
+		return 0;
+
+	vterm_get_size(self->vt, &rows, &cols);
+	if (dest.start_col != 0 || dest.end_col != cols ||
+	    src.start_col != 0 || src.end_col != cols)
+		return 0;
+
+	sc = &self->scroll;
+	n = src.start_row - dest.start_row;
+	top = (src.start_row < dest.start_row) ? src.start_row : dest.start_row;
+	bottom = (src.end_row > dest.end_row) ? src.end_row : dest.end_row;
+	if (sc->n && (sc->top != top || sc->bottom != bottom))
+		return 0;
+
+	damage_shift(&self->damage, top, bottom, n);
+	sc->top = top;
+	sc->bottom = bottom;
+	sc->n += n;
+
+	/* the snapshot copies the moved rows, the window does not repaint them */
+	if (top < self->dmg_lo)
+		self->dmg_lo = top;
+	if (bottom > self->dmg_hi)
+		self->dmg_hi = bottom;
+
+	iterm_post(self, ITERM_EV_DIRTY);
+	return 1;
+}
+
+static int cb_settermprop(VTermProp prop, VTermValue *val, void *user)
+{
+	iterm_t *self = (iterm_t *) user;
+
+	if (prop == VTERM_PROP_MOUSE) {
+		__atomic_store_n(&self->is_mouse_mode, val->number,
+				 __ATOMIC_RELAXED);
+	}
+
+	if (prop == VTERM_PROP_TITLE) {
+		strncpy(self->title, val->string, sizeof(self->title) - 1);
+		iterm_post(self, ITERM_EV_TITLE);
+	}
+
+	/* just handle closing altscreen only */
+	if (prop == VTERM_PROP_ALTSCREEN && !val->boolean) {
+		self->is_altscreen = 0;
+		iterm_post(self, ITERM_EV_ALT_OFF | ITERM_EV_DIRTY);
+	}
+	return 1;
+}
+
+static VTermScreenCallbacks screen_cbs = {
+	.damage = cb_damage,
+	.moverect = cb_moverect,
+	.sb_pushline = cb_sb_pushline,
+	.movecursor = cb_movecursor,
+	.settermprop = cb_settermprop,
+};
+
+/*  Lifecycle  */
+
+static void iterm_apply(cosh_win_t *win, iterm_t *self);
+static int snap_resize(iterm_t *self, int rows, int cols);
+
+static void iterm_sync_size(cosh_win_t *win)
+{
+	iterm_t *self = (iterm_t *) win->priv;
+	if (!self || self->fd < 0)
+		return;
+
+	struct winsize ws = {.ws_row = (unsigned short)win->vh,.ws_col =
+		    (unsigned short)win->vw
+	};
+	ioctl(self->fd, TIOCSWINSZ, &ws);
+
+	iterm_lock(self);
+	vterm_set_size(self->vt, win->vh, win->vw);
+	self->scroll.n = 0;
+	if (self->io_mode == ITERM_IO_PARSER)
+		snap_resize(self, win->vh, win->vw);
+	iterm_unlock(self);
+
+	iterm_apply(win, self);
+	if (self->active)
+		kill(self->pid, SIGWINCH);
+}
+
+/**
+ * iterm_on_exit - The shell was reaped, close its window without waiting for EIO
+ */
+static void iterm_on_exit(pid_t pid, int status, void *data)
+{
+	cosh_win_t *win = (cosh_win_t *) data;
+	iterm_t *self = (iterm_t *) win->priv;
+	(void)pid;
+	(void)status;
+
+	if (self) {
+		self->pid = -1;
+		self->active = 0;
+	}
+
+	win_destroy(win);
+}
+
+static void iterm_spawn(iterm_t *self, cosh_win_t *win)
+{
+	int r = win->vh;
+	int c = win->vw;
+
+	struct winsize ws = {.ws_row = (unsigned short)r,.ws_col =
+		    (unsigned short)c
+	};
+	self->pid = forkpty(&self->fd, NULL, NULL, &ws);
+
+	if (self->pid < 0) {
+		c_log_error("forkpty failed: %s", strerror(errno));
+		return;
+	}
+
+	if (self->pid == 0) {
+		c_proc_child_setup();
+		setenv("TERM", "xterm-256color", 1);
+		setenv("LANG", "en_US.UTF-8", 1);
+		char *SHELL = getenv("SHELL");
+
+		if (!SHELL)
+			SHELL = "/bin/bash";
+
+		execl(SHELL, SHELL, NULL);
+		_exit(1);
+	}
+
+	self->active = 1;
+	fcntl(self->fd, F_SETFL, O_NONBLOCK);
+	fcntl(self->fd, F_SETFD, FD_CLOEXEC);	/* keep it out of other shells */
+	c_proc_watch(self->pid, iterm_on_exit, win);
+}
+
+/**
+ * iterm_feed - Scan a chunk of pty output for screen resets and parse it
+ * Called with the vt lock held, possibly on the parser thread.
+ */
+static void iterm_feed(iterm_t *self, const char *buf, size_t n)
+{
+	size_t j = 0;
+
+	size_t terminal_seq_count =
+	    sizeof(terminal_control_seq) / sizeof(terminal_control_seq[0]);
+	for (j = 0; j < terminal_seq_count; j++) {
+		if (memmem(buf, n, terminal_control_seq[j].seq,
+			   terminal_control_seq[j].len)) {
+			switch (terminal_control_seq[j].id) {
+			case 0:	/* home */
+			case 1:	/* soft clear */
+				iterm_post(self, ITERM_EV_DIRTY);
+				break;
+
+			case 2:
+				clear_history(self);
+				iterm_post(self, ITERM_EV_HIST_CLEAR);
+				break;
+			}
+		}
+	}
+
+	/* This is fucking shit best */
+	size_t altscreen_open_count =
+	    sizeof(altscreen_open_seq) / sizeof(altscreen_open_seq[0]);
+	for (j = 0; j < altscreen_open_count; j++) {
+		if (memmem(buf, n, altscreen_open_seq[j].seq,
+			   altscreen_open_seq[j].len)) {
+			if (!self->is_altscreen) {
+				self->is_altscreen = 1;
+				iterm_post(self, ITERM_EV_ALT_ON);
+				break;
+			}
+		}
+	}
+
+	vterm_input_write(self->vt, buf, n);
+	iterm_post(self, ITERM_EV_DIRTY);
+}
+
+/**
+ * iterm_mark_damage - Hand the bounding box of our damage to the WM
+ */
+static void iterm_mark_damage(cosh_win_t *win, iterm_t *self)
+{
+	iterm_damage_t *d = &self->damage;
+	iterm_scroll_t *sc = &self->scroll;
+	VTermRect b;
+
+	if (self->io_mode == ITERM_IO_PARSER) {
+		pthread_mutex_lock(&self->snap_lock);
+		d = &self->damage_ready;
+		sc = &self->scroll_ready;
+	}
+
+	/* a scroll alone still needs a render to happen */
+	if (sc->n > 0)
+		win_mark_dirty_rect(win, sc->bottom - 1, 0, 1, win->vw);
+	else if (sc->n < 0)
+		win_mark_dirty_rect(win, sc->top, 0, 1, win->vw);
+
+	if (d->count > 0) {
+		b = d->rect[0];
+		for (int i = 1; i < d->count; i++)
+			rect_union(&b, &d->rect[i]);
+		win_mark_dirty_rect(win, b.start_row, b.start_col,
+				    b.end_row - b.start_row,
+				    b.end_col - b.start_col);
+	}
+
+	if (self->io_mode == ITERM_IO_PARSER)
+		pthread_mutex_unlock(&self->snap_lock);
+}
+
+/**
+ * iterm_apply - Apply what the parser posted to the window (main thread)
+ */
+static void iterm_apply(cosh_win_t *win, iterm_t *self)
+{
+	int ev = __atomic_exchange_n(&self->events, 0, __ATOMIC_SEQ_CST);
+	int hist_cnt;
+
+	if (!ev)
+		return;
+
+	iterm_lock(self);
+	hist_cnt = c_hist_lines(&self->hist);
+	if (ev & ITERM_EV_TITLE) {
+		if (self->find.active)
+			memcpy(self->find.title, self->title, sizeof(self->title));
+		else
+			win_setopt(win, WIN_OPT_TITLE, self->title);
+	}
+	if (ev & ITERM_EV_HIST_CLEAR) {
+		self->find.origin = INT64_MAX;
+		self->find.found = 0;
+	}
+	if ((ev & ITERM_EV_ALT_ON) && self->find.active) {
+		self->find.active = 0;
+		win_setopt(win, WIN_OPT_TITLE, self->find.title);
+	}
+	if (ev & ITERM_EV_TX)
+		tx_kick(self);
+	iterm_unlock(self);
+
+	if (ev & (ITERM_EV_HIST_CLEAR | ITERM_EV_ALT_ON)) {
+		win->scroll_cur = 0;
+		win->scroll_max = 0;
+	}
+
+	if (ev & ITERM_EV_ALT_OFF) {
+		win->scroll_cur = hist_cnt;
+		win->scroll_max = hist_cnt;
+	}
+
+	/* follow the output unless the user scrolled back */
+	if (ev & ITERM_EV_PUSHLINE) {
+		if (win->scroll_cur >= win->scroll_max - 1)
+			win->scroll_cur = hist_cnt;
+		win->scroll_max = hist_cnt;
+	}
+
+	/* the screen moved under the viewport, or the view shows history */
+	if ((ev & (ITERM_EV_HIST_CLEAR | ITERM_EV_ALT_ON | ITERM_EV_ALT_OFF)) ||
+	    win->scroll_cur < win->scroll_max) {
+		win->dirty = 1;
+		win_needs_redraw = 1;
+		return;
+	}
+
+	if (ev & ITERM_EV_DIRTY)
+		iterm_mark_damage(win, self);
+}
+
+/*  Parser snapshot  */
+
+static void snap_free(iterm_t *self)
+{
+	for (int i = 0; i < 2; i++) {
+		free(self->snap[i].cells);
+		self->snap[i].cells = NULL;
+		self->snap[i].rows = self->snap[i].cols = 0;
+	}
+	free(self->snap_stale);
+	self->snap_stale = NULL;
+}
+
+/**
+ * snap_publish - Copy damaged rows into the back buffer and flip it
+ * Called with the vt lock held.
+ */
+static void snap_publish(iterm_t *self)
+{
+	iterm_snap_t *back = &self->snap[!self->snap_front];
+	VTermScreenCell cell;
+	VTermPos pos;
+
+	for (pos.row = 0; pos.row < back->rows; pos.row++) {
+		int damaged = pos.row >= self->dmg_lo && pos.row < self->dmg_hi;
+
+		if (!damaged && !self->snap_stale[pos.row])
+			continue;
+
+		iterm_cell_t *dst = &back->cells[pos.row * back->cols];
+		for (pos.col = 0; pos.col < back->cols; pos.col++) {
+			if (!vterm_screen_get_cell(self->vts, pos, &cell))
+				memset(&cell, 0, sizeof(cell));
+			cell_pack(&dst[pos.col], &cell);
+		}
+		self->snap_stale[pos.row] = 0;
+	}
+
+	vterm_state_get_cursorpos(vterm_obtain_state(self->vt), &back->cursor);
+	back->altscreen = self->is_altscreen;
+
+	pthread_mutex_lock(&self->snap_lock);
+	self->snap_front = !self->snap_front;
+	scroll_take(&self->scroll_ready, &self->damage_ready, &self->scroll,
+		    &self->damage, back->cols);
+	pthread_mutex_unlock(&self->snap_lock);
+
+	/* the new back buffer only lacks what changed in this batch */
+	for (int r = self->dmg_lo; r < self->dmg_hi && r < back->rows; r++)
+		self->snap_stale[r] = 1;
+
+	self->dmg_lo = back->rows;
+	self->dmg_hi = 0;
+}
+
+/**
+ * snap_resize - Reallocate both buffers and republish everything
+ * Called with the vt lock held.
+ */
+static int snap_resize(iterm_t *self, int rows, int cols)
+{
+	pthread_mutex_lock(&self->snap_lock);
+	snap_free(self);
+
+	for (int i = 0; i < 2; i++) {
+		self->snap[i].cells = calloc((size_t)rows * cols,
+					     sizeof(iterm_cell_t));
+		self->snap[i].rows = rows;
+		self->snap[i].cols = cols;
+	}
+	self->snap_stale = malloc((size_t)rows);
+	self->scroll_ready.n = 0;
+	pthread_mutex_unlock(&self->snap_lock);
+
+	if (!self->snap[0].cells || !self->snap[1].cells || !self->snap_stale) {
+		snap_free(self);
+		return -1;
+	}
+
+	memset(self->snap_stale, 1, (size_t)rows);
+	self->dmg_lo = 0;
+	self->dmg_hi = rows;
+	snap_publish(self);
+	return 0;
+}
+
+static void eventfd_signal(int fd)
+{
+	uint64_t one = 1;
+	ssize_t r = write(fd, &one, sizeof(one));
+	(void)r;
+}
+
+/**
+ * iterm_reader - Threaded I/O producer, drains the pty into self->rx
+ * Touches nothing but the pty, the ring and the flags below. The parser
+ * stays on the main thread.
+ */
+static void *iterm_reader(void *arg)
+{
+	iterm_t *self = (iterm_t *) arg;
+	struct pollfd pfd[2] = {
+		{.fd = self->wake_fd,.events = POLLIN},
+		{.fd = self->fd,.events = POLLIN},
+	};
+
+	while (!__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) {
+		size_t room;
+		void *dst = c_ring_write_ptr(&self->rx, &room);
+
+		if (room == 0) {
+			/* ask for a wakeup, then recheck so it cannot be missed */
+			__atomic_store_n(&self->starved, 1, __ATOMIC_SEQ_CST);
+			dst = c_ring_write_ptr(&self->rx, &room);
+		}
+
+		if (poll(pfd, room ? 2 : 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			uint64_t v;
+			ssize_t r = read(self->wake_fd, &v, sizeof(v));
+			(void)r;
+			continue;
+		}
+
+		if (!room || !(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		ssize_t n = read(self->fd, dst, room);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		if (n <= 0) {
+			__atomic_store_n(&self->eof, 1, __ATOMIC_RELEASE);
+			eventfd_signal(self->notify_fd);
+			break;
+		}
+
+		c_ring_commit(&self->rx, (size_t)n);
+		if (__atomic_exchange_n(&self->armed, 0, __ATOMIC_SEQ_CST))
+			eventfd_signal(self->notify_fd);
+	}
+
+	return NULL;
+}
+
+/**
+ * iterm_tick_ring - Threaded I/O consumer, parses what the reader queued
+ */
+static int iterm_tick_ring(cosh_win_t *win, iterm_t *self)
+{
+	uint64_t v;
+	ssize_t r = read(self->notify_fd, &v, sizeof(v));
+	(void)r;
+
+	while (1) {
+		size_t budget = win_io_budget(win);
+		size_t avail;
+		const char *src = c_ring_read_ptr(&self->rx, &avail);
+
+		if (avail == 0) {
+			if (__atomic_load_n(&self->eof, __ATOMIC_ACQUIRE)) {
+				win_destroy(win);
+				return LOOP_DONE;
+			}
+
+			/* arm, then recheck so a commit in between is not lost */
+			__atomic_store_n(&self->armed, 1, __ATOMIC_SEQ_CST);
+			if (c_ring_used(&self->rx) == 0) {
+				iterm_apply(win, self);
+				return LOOP_DONE;
+			}
+			__atomic_store_n(&self->armed, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		if (budget == 0) {
+			win_io_throttle(win, c_ring_used(&self->rx));
+			iterm_apply(win, self);
+			return LOOP_AGAIN;
+		}
+
+		if (avail > budget)
+			avail = budget;
+
+		iterm_feed(self, src, avail);
+		c_ring_consume(&self->rx, avail);
+		win_io_consume(win, avail);
+
+		if (__atomic_exchange_n(&self->starved, 0, __ATOMIC_SEQ_CST))
+			eventfd_signal(self->wake_fd);
+	}
+}
+
+/**
+ * iterm_parser - ITERM_IO_PARSER thread, reads and parses the pty
+ * The main thread only renders the published snapshot, so parsing for
+ * several terminals runs on several cores.
+ */
+static void *iterm_parser(void *arg)
+{
+	iterm_t *self = (iterm_t *) arg;
+	char buf[READ_BUF_SIZE];
+	struct pollfd pfd[2] = {
+		{.fd = self->wake_fd,.events = POLLIN},
+		{.fd = self->fd,.events = POLLIN},
+	};
+
+	while (!__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			continue;	/* stop request */
+
+		ssize_t n = read(self->fd, buf, sizeof(buf));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		if (n <= 0) {
+			__atomic_store_n(&self->eof, 1, __ATOMIC_RELEASE);
+			eventfd_signal(self->notify_fd);
+			break;
+		}
+
+		pthread_mutex_lock(&self->vt_lock);
+		iterm_feed(self, buf, (size_t)n);
+		snap_publish(self);
+		pthread_mutex_unlock(&self->vt_lock);
+
+		if (__atomic_exchange_n(&self->armed, 0, __ATOMIC_SEQ_CST))
+			eventfd_signal(self->notify_fd);
+	}
+
+	return NULL;
+}
+
+/**
+ * iterm_tick_parsed - Main thread side of ITERM_IO_PARSER
+ */
+static int iterm_tick_parsed(cosh_win_t *win, iterm_t *self)
 {
-	if (c.type != VTERM_COLOR_INDEXED)
-		return -1;
-	return ((unsigned char *)&c)[1];
+	uint64_t v;
+	ssize_t r = read(self->notify_fd, &v, sizeof(v));
+	(void)r;
+
+	/* arm first, anything posted after this point signals again */
+	__atomic_store_n(&self->armed, 1, __ATOMIC_SEQ_CST);
+	iterm_apply(win, self);
+
+	if (__atomic_load_n(&self->eof, __ATOMIC_ACQUIRE))
+		win_destroy(win);
+
+	return LOOP_DONE;
 }
 
-static int get_pair(iterm_t *self, int vfg, int vbg)
+static int iterm_start_reader(iterm_t *self, int mode, int rows, int cols)
 {
-	(void)self;
-	int fg = (vfg >= 0 && vfg < 256) ? vfg : -1;
-	int bg = (vbg >= 0 && vbg < 256) ? vbg : -1;
-
-	if (fg == -1 && bg == -1)
-		return CP_WIN_START;
+	void *(*routine)(void *) = iterm_reader;
+
+	/* set before the thread exists, it decides whether we lock */
+	self->io_mode = (mode >= ITERM_IO_PARSER) ? ITERM_IO_PARSER :
+	    ITERM_IO_READER;
+
+	if (self->io_mode == ITERM_IO_PARSER) {
+		routine = iterm_parser;
+		if (snap_resize(self, rows, cols) != 0)
+			goto fail_mode;
+	} else if (c_ring_init(&self->rx, RING_SIZE) != 0) {
+		goto fail_mode;
+	}
 
-	int p_idx = (vfg + 1) * 257 + (vbg + 1);
-	int p = CP_WIN_START + 100 + (p_idx % 20000);
-	static int initialized[20000] = { 0 };
-	if (!initialized[p_idx % 20000]) {
-		init_pair(p, fg, bg);
-		initialized[p_idx % 20000] = 1;
+	self->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	self->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	self->armed = 1;
+
+	if (self->notify_fd < 0 || self->wake_fd < 0 ||
+	    pthread_create(&self->reader, NULL, routine, self) != 0) {
+		c_log_error("Cannot start terminal reader: %s", strerror(errno));
+		if (self->notify_fd >= 0)
+			close(self->notify_fd);
+		if (self->wake_fd >= 0)
+			close(self->wake_fd);
+		c_ring_free(&self->rx);
+		snap_free(self);
+		goto fail_mode;
 	}
-	return p;
-}
 
-/*  History Management  */
+	self->threaded = 1;
+	return 0;
 
-static void free_line(iterm_line_t *line)
+ fail_mode:
+	self->io_mode = ITERM_IO_INLINE;
+	return -1;
+}
+
+static void iterm_stop_reader(iterm_t *self)
 {
-	if (line && line->cells)
-		free(line->cells);
-	if (line) {
-		line->cells = NULL;
-		line->cols = 0;
-	}
+	if (!self->threaded)
+		return;
+
+	__atomic_store_n(&self->stop, 1, __ATOMIC_RELEASE);
+	eventfd_signal(self->wake_fd);
+	pthread_join(self->reader, NULL);
+
+	close(self->notify_fd);
+	close(self->wake_fd);
+	c_ring_free(&self->rx);
+	snap_free(self);
+	self->threaded = 0;
+	self->io_mode = ITERM_IO_INLINE;
 }
 
-static int cb_sb_pushline(int cols, const VTermScreenCell *cells, void *user)
+/*  App Callbacks  */
+
+int app_iterm_tick(cosh_win_t *win)
 {
-	cosh_win_t *win = (cosh_win_t *) user;
 	iterm_t *self = (iterm_t *) win->priv;
+	char buf[READ_BUF_SIZE];
 
-	if (!self || !self->history || self->is_altscreen)
-		return 1;
+	if (!self || !self->active || self->fd < 0)
+		return LOOP_DONE;
 
-	/**
-	 * If hist_head reaches 1023, then (1023 + 1) % 1024 will return 0.
-	 * This forces the index back to the beginning to overwrite the oldest data.
-	 */
-	int idx = (self->hist_head + 1) % HIST_SIZE;
+	if (self->io_mode == ITERM_IO_PARSER)
+		return iterm_tick_parsed(win, self);
 
-	//this if the idx = 0 and head at 1024, then: oldest data will be GONE
-	free_line(&self->history[idx]);
-	self->history[idx].cells = malloc(sizeof(iterm_cell_t) * cols);
-	if (!self->history[idx].cells)
-		return 0;
+	if (self->threaded)
+		return iterm_tick_ring(win, self);
 
-	self->history[idx].cols = cols;
+	/* edge triggered: drain until EAGAIN or until the frame budget is spent */
+	while (1) {
+		size_t budget = win_io_budget(win);
 
-	for (int i = 0; i < cols; i++) {
-		memcpy(self->history[idx].cells[i].chars, cells[i].chars,
-		       sizeof(uint32_t) * MAX_CELL_CHARS);
-		self->history[idx].cells[i].fg = get_color_idx(cells[i].fg);
-		self->history[idx].cells[i].bg = get_color_idx(cells[i].bg);
-		self->history[idx].cells[i].attrs = cells[i].attrs;
-	}
+		if (budget == 0) {
+			int pending = 0;
 
-	self->hist_head = idx;
-	if (self->hist_cnt < HIST_SIZE)
-		self->hist_cnt++;
+			iterm_apply(win, self);
+			/* nothing left means the next write raises a fresh edge */
+			if (ioctl(self->fd, FIONREAD, &pending) == 0 && pending <= 0)
+				return LOOP_DONE;
+			win_io_throttle(win, (size_t)pending);
+			return LOOP_AGAIN;
+		}
 
-	win->scroll_max = self->hist_cnt;
+		ssize_t n = read(self->fd, buf,
+				 budget < sizeof(buf) ? budget : sizeof(buf));
 
-	if (win->scroll_cur >= win->scroll_max - 1) {
-		win->scroll_cur = win->scroll_max;
-	}
+		//close window on exit
+		if (n == 0 || (n < 0 && errno == EIO)) {
+			win_destroy(win);
+			return LOOP_DONE;
+		}
 
-	return 1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				self->active = 0;
+			iterm_apply(win, self);
+			return LOOP_DONE;
+		}
+
+		iterm_feed(self, buf, (size_t)n);
+		win_io_consume(win, (size_t)n);
+	}
 }
 
-static int cb_movecursor(VTermPos pos, VTermPos oldpos, int visible, void *user)
+/* Scrollback search */
+
+static iterm_line_t *hist_line(iterm_t *self, uint64_t line)
 {
-	(void)pos;
-	(void)oldpos;
-	(void)visible;
-	if (user) {
-		cosh_win_t *win = (cosh_win_t *) user;
-		win->dirty = 1;
-	}
-	return 1;
+	if (line >= self->hist_seq)
+		return NULL;
+	return c_hist_get(&self->hist, (int)(self->hist_seq - 1 - line));
 }
 
-static int cb_damage(VTermRect rect, void *user)
+/**
+ * find_in_line - Match in history line @line relative to column @bound
+ * Going back (@dir < 0) it is the last one starting before @bound,
+ * forward the first one starting after it.
+ */
+static int find_in_line(iterm_t *self, uint64_t line, int bound, int dir)
 {
-	(void)rect;
-	if (user)
-		((cosh_win_t *) user)->dirty = 1;
+	iterm_find_t *f = &self->find;
+	iterm_line_t *l = hist_line(self, line);
+	int n, best = -1;
+
+	if (!l || (n = line_text(self, l, f->fold)) < f->len)
+		return 0;
+
+	for (int k = c_find_scan(self->find_text, n, f->needle, f->len, 0);
+	     k >= 0;
+	     k = c_find_scan(self->find_text, n, f->needle, f->len, k + 1)) {
+		if (dir > 0 ? self->find_col[k] > bound :
+		    self->find_col[k] < bound)
+			best = k;
+		if (dir > 0 ? best >= 0 : self->find_col[k] >= bound)
+			break;
+	}
+
+	if (best < 0)
+		return 0;
+
+	f->found = 1;
+	f->line = line;
+	f->col = self->find_col[best];
+	f->end = (best + f->len < n) ? self->find_col[best + f->len] : l->cols;
 	return 1;
 }
 
-static int cb_settermprop(VTermProp prop, VTermValue *val, void *user)
+/**
+ * find_from - Next match from (@line, @bound) in direction @dir
+ * Blocks of lines whose trigram filter rules the needle out are not
+ * read at all, which keeps a search through cold or spilled history
+ * to the few blocks that may match.
+ */
+static int find_from(iterm_t *self, int64_t line, int bound, int dir)
 {
-	cosh_win_t *win = (cosh_win_t *) user;
-	iterm_t *self = (iterm_t *) win->priv;
+	iterm_find_t *f = &self->find;
+	int64_t oldest = (int64_t)(self->hist_seq - c_hist_lines(&self->hist));
+	int64_t newest = (int64_t)self->hist_seq - 1;
+	int64_t block = -1;
 
-	if (prop == VTERM_PROP_MOUSE) {
-		self->is_mouse_mode = val->number;
-	}
+	if (f->len == 0)
+		return 0;
 
-	if (prop == VTERM_PROP_TITLE) {
-		win_setopt(win, WIN_OPT_TITLE, val->string);
+	if (line > newest) {
+		line = newest;
+		bound = INT_MAX;
+	} else if (line < oldest) {
+		line = oldest;
+		bound = -1;
 	}
 
-	/* just handle closing altscreen only */
-	if (prop == VTERM_PROP_ALTSCREEN && !val->boolean) {
-		self->is_altscreen = 0;
-		win->scroll_cur = self->hist_cnt;
-		win->scroll_max = self->hist_cnt;
+	while (line >= oldest && line <= newest) {
+		int64_t b = line / FIND_BLOCK;
+
+		if (b != block) {
+			block = b;
+			if (!c_find_idx_test(&self->find_idx, (uint64_t)b,
+					     f->keys, f->nkeys)) {
+				line = (dir < 0) ? b * FIND_BLOCK - 1 :
+				    (b + 1) * FIND_BLOCK;
+				bound = (dir < 0) ? INT_MAX : -1;
+				continue;
+			}
+		}
 
-		win->dirty = 1;
-		win_needs_redraw = 1;
+		if (find_in_line(self, (uint64_t)line, bound, dir))
+			return 1;
+
+		line += dir;
+		bound = (dir < 0) ? INT_MAX : -1;
 	}
-	return 1;
+	return 0;
 }
 
-static VTermScreenCallbacks screen_cbs = {
-	.damage = cb_damage,
-	.sb_pushline = cb_sb_pushline,
-	.movecursor = cb_movecursor,
-	.settermprop = cb_settermprop,
-};
-
-/*  Lifecycle  */
+static void find_title(cosh_win_t *win, iterm_find_t *f)
+{
+	wchar_t wneedle[FIND_MAX + 1];
+	char needle[FIND_MAX * 4 + 1];
+	char title[sizeof(win->title)];
+
+	for (int i = 0; i < f->len; i++)
+		wneedle[i] = (wchar_t)f->needle[i];
+	wneedle[f->len] = L'\0';
+	if (wcstombs(needle, wneedle, sizeof(needle)) == (size_t)-1)
+		needle[0] = '\0';
+
+	snprintf(title, sizeof(title), "%s: %s",
+		 (f->found || f->len == 0) ? "Find" : "Find (no match)", needle);
+	win_setopt(win, WIN_OPT_TITLE, title);
+}
 
-static void iterm_sync_size(cosh_win_t *win)
+/* scroll the current match to the middle of the window */
+static void find_show(cosh_win_t *win, iterm_t *self)
 {
-	iterm_t *self = (iterm_t *) win->priv;
-	if (!self || self->fd < 0)
-		return;
+	iterm_find_t *f = &self->find;
+	int total = c_hist_lines(&self->hist);
+	int off;
+
+	if (f->found) {
+		off = (int)(self->hist_seq - f->line) + win->vh / 2;
+		win->scroll_max = total;
+		win->scroll_cur = total - ((off < total) ? off : total);
+	}
 
-	struct winsize ws = {.ws_row = (unsigned short)win->vh,.ws_col =
-		    (unsigned short)win->vw
-	};
-	ioctl(self->fd, TIOCSWINSZ, &ws);
-	vterm_set_size(self->vt, win->vh, win->vw);
-	if (self->active)
-		kill(self->pid, SIGWINCH);
+	find_title(win, f);
+	win->dirty = 1;
 }
 
-static void iterm_spawn(iterm_t *self, cosh_win_t *win)
+/**
+ * find_update - Search again after the needle changed
+ * A longer needle can only match at or above the current match, a
+ * shorter one starts over from where the search began.
+ */
+static void find_update(cosh_win_t *win, iterm_t *self, int grown)
 {
-	int r = win->vh;
-	int c = win->vw;
+	iterm_find_t *f = &self->find;
 
-	struct winsize ws = {.ws_row = (unsigned short)r,.ws_col =
-		    (unsigned short)c
-	};
-	self->pid = forkpty(&self->fd, NULL, NULL, &ws);
+	f->fold = 1;
+	for (int i = 0; i < f->len; i++)
+		if (f->needle[i] != c_find_fold(f->needle[i]))
+			f->fold = 0;
+	f->nkeys = c_find_keys(f->needle, f->len, f->keys);
 
-	if (self->pid == 0) {
-		setenv("TERM", "xterm-256color", 1);
-		setenv("LANG", "en_US.UTF-8", 1);
-		char *SHELL = getenv("SHELL");
+	if (grown && f->found) {
+		f->found = 0;
+		find_from(self, (int64_t)f->line, f->col + 1, -1);
+	} else {
+		f->found = 0;
+		find_from(self, f->origin, INT_MAX, -1);
+	}
 
-		if (!SHELL)
-			SHELL = "/bin/bash";
+	find_show(win, self);
+}
 
-		execl(SHELL, SHELL, NULL);
-		_exit(1);
+static void find_step(cosh_win_t *win, iterm_t *self, int dir)
+{
+	iterm_find_t *f = &self->find;
+	iterm_find_t prev = *f;
+
+	if (!f->found) {
+		find_update(win, self, 0);
+		return;
 	}
 
-	self->active = 1;
-	fcntl(self->fd, F_SETFL, O_NONBLOCK);
-}
+	if (!find_from(self, (int64_t)f->line, f->col, dir)) {
+		*f = prev;
+		win_ding();
+		return;
+	}
 
-/*  App Callbacks  */
+	find_show(win, self);
+}
 
-void app_iterm_tick(cosh_win_t *win)
+static void find_enter(cosh_win_t *win, iterm_t *self)
 {
-	iterm_t *self = (iterm_t *) win->priv;
-	char buf[READ_BUF_SIZE];
+	iterm_find_t *f = &self->find;
+	int off = win->scroll_max - win->scroll_cur;
 
-	if (!self || !self->active || self->fd < 0)
-		return;
+	memset(f, 0, sizeof(*f));
+	f->active = 1;
+	memcpy(f->title, win->title, sizeof(f->title));
 
-	ssize_t n = read(self->fd, buf, sizeof(buf));
+	/* from the lowest history line in view, or the newest */
+	f->origin = INT64_MAX;
+	if (off > 0)
+		f->origin = (int64_t)self->hist_seq - 1 -
+		    (off - ((off < win->vh) ? off : win->vh));
 
-	//close window on exit
-	if (n == 0 || (n < 0 && errno == EIO)) {
-		win_destroy(win);
-		return;
+	find_title(win, f);
+}
+
+static void find_exit(cosh_win_t *win, iterm_t *self)
+{
+	self->find.active = 0;
+	win_setopt(win, WIN_OPT_TITLE, self->find.title);
+	win->dirty = 1;
+}
+
+/**
+ * find_input - Keys while searching, returns 0 for those it leaves alone
+ * Typing extends the search, Enter, Up and ^R go to older matches,
+ * Down and ^S to newer ones, Esc, ^G or MOD + find again end it. The
+ * view stays at the match.
+ */
+static int find_input(cosh_win_t *win, iterm_t *self, int ch)
+{
+	iterm_find_t *f = &self->find;
+
+	if (ch == WIN_KEY_FIND) {
+		if (f->active)
+			find_exit(win, self);
+		else if (!self->is_altscreen && self->hist.rec)
+			find_enter(win, self);
+		else
+			win_ding();
+		return 1;
 	}
 
-	if (n > 0) {
-		size_t j = 0;
-
-		size_t terminal_seq_count =
-		    sizeof(terminal_control_seq) /
-		    sizeof(terminal_control_seq[0]);
-		for (j = 0; j < terminal_seq_count; j++) {
-			if (memmem
-			    (buf, n, terminal_control_seq[j].seq,
-			     terminal_control_seq[j].len)) {
-				switch (terminal_control_seq[j].id) {
-				case 0:	/* home */
-					win->dirty = 1;
-					break;
-
-				case 1:	/* soft clear */
-					win->dirty = 1;
-					break;
-
-				case 2:
-					self->hist_cnt = 0;
-					self->hist_head = 0;
-					if (self->history) {
-						for (int i = 0; i < HIST_SIZE;
-						     i++)
-							free_line(&self->history
-								  [i]);
-					}
-
-					win->scroll_cur = 0;
-					win->scroll_max = 0;
-					win->dirty = 1;
-					break;
-				}
-			}
+	if (!f->active || ch == KEY_MOUSE || ch == WIN_MOUSE_SCROLL_UP ||
+	    ch == WIN_MOUSE_SCROLL_DOWN)
+		return 0;
+
+	switch (ch) {
+	case 27:
+	case CTRL('g'):
+		find_exit(win, self);
+		break;
+	case '\n':
+	case KEY_ENTER:
+	case KEY_UP:
+	case CTRL('r'):
+		find_step(win, self, -1);
+		break;
+	case KEY_DOWN:
+	case CTRL('s'):
+		find_step(win, self, 1);
+		break;
+	case KEY_BACKSPACE:
+	case 127:
+	case 8:
+		if (f->len > 0) {
+			f->len--;
+			find_update(win, self, 0);
 		}
+		break;
+	default:
+		if (ch >= 32 && ch <= 126 && f->len < FIND_MAX) {
+			f->needle[f->len++] = (uint32_t)ch;
+			find_update(win, self, 1);
+		}
+		break;
+	}
+	return 1;
+}
 
-		/* This is fucking shit best */
-		size_t altscreen_open_count =
-		    sizeof(altscreen_open_seq) / sizeof(altscreen_open_seq[0]);
-		for (j = 0; j < altscreen_open_count; j++) {
-			if (memmem
-			    (buf, n, altscreen_open_seq[j].seq,
-			     altscreen_open_seq[j].len)) {
-				if (!self->is_altscreen) {
-					self->is_altscreen = 1;
-					win->scroll_cur = 0;
-					win->scroll_max = 0;
-					win->dirty = 1;
-					win_needs_redraw = 1;
-					break;
-				}
+/**
+ * find_mark - Highlight the matches in history line @line
+ * Every match is drawn reversed, the current one bold and underlined.
+ */
+static void find_mark(iterm_t *self, const iterm_line_t *l, uint64_t line,
+		      iterm_cell_t *cells, int ncells)
+{
+	iterm_find_t *f = &self->find;
+	int n = line_text(self, l, f->fold);
+
+	for (int k = c_find_scan(self->find_text, n, f->needle, f->len, 0);
+	     k >= 0;
+	     k = c_find_scan(self->find_text, n, f->needle, f->len,
+			     k + f->len)) {
+		int c0 = self->find_col[k];
+		int c1 = (k + f->len < n) ? self->find_col[k + f->len] : l->cols;
+		int cur = f->found && f->line == line && f->col == c0;
+
+		for (int i = c0; i < c1 && i < ncells; i++) {
+			cells[i].attrs.reverse = !cells[i].attrs.reverse;
+			if (cur) {
+				cells[i].attrs.bold = 1;
+				cells[i].attrs.underline = 1;
 			}
 		}
-
-		vterm_input_write(self->vt, buf, (size_t)n);
-		win->dirty = 1;
-		win_needs_redraw = 1;
-	} else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-		self->active = 0;
+	}
 }
 
 void app_iterm_input(cosh_win_t *win, int ch, MEVENT *ev)
 {
 	iterm_t *self = (iterm_t *) win->priv;
+	int lost;
 
 	if (!self || !self->active)
 		return;
 
+	iterm_lock(self);
+
+	if (find_input(win, self, ch))
+		goto unlock;
+
 	if (ch == KEY_MOUSE) {
 	    if (self->is_mouse_mode > 0 && ev != NULL) {
 		int vterm_row = ev->y - win->y - 1;
@@ -380,7 +1741,7 @@ void app_iterm_input(cosh_win_t *win, int ch, MEVENT *ev)
 				    (win->scroll_cur >
 				     2) ? win->scroll_cur - 2 : 0;
 			win->dirty = 1;
-			return;
+			goto unlock;
 		} else if (ch == WIN_MOUSE_SCROLL_DOWN) {
 			if (win->scroll_cur < win->scroll_max)
 				win->scroll_cur =
@@ -388,7 +1749,7 @@ void app_iterm_input(cosh_win_t *win, int ch, MEVENT *ev)
 				     win->scroll_max) ? win->scroll_max : win->
 				    scroll_cur + 2;
 			win->dirty = 1;
-			return;
+			goto unlock;
 		}
 	}
 	VTermKey k = VTERM_KEY_NONE;
@@ -439,48 +1800,237 @@ void app_iterm_input(cosh_win_t *win, int ch, MEVENT *ev)
 	else
 		vterm_keyboard_unichar(self->vt, (uint32_t) ch, VTERM_MOD_NONE);
 
- send_output:{
-		char out[128];
-		size_t len = vterm_output_read(self->vt, out, sizeof(out));
-		if (len > 0) {
-			win->scroll_cur = win->scroll_max;
-			(void)write(self->fd, out, len);
-		}
+ send_output:
+	/* cb_output queued the bytes, typing snaps back to the bottom */
+	if (self->tx_head) {
+		if (win->scroll_cur != win->scroll_max)
+			win->dirty = 1;
+		win->scroll_cur = win->scroll_max;
+		tx_kick(self);
 	}
+
+ unlock:
+	/* keys that never reached the shell, at least let the user know */
+	lost = self->tx_lost;
+	self->tx_lost = 0;
+	iterm_unlock(self);
+
+	if (lost)
+		win_ding();
 }
 
-static void draw_cell(WINDOW *w, int y, int x, uint32_t *chars, int pair,
-		      VTermScreenCell attrs)
+static inline attr_t cell_attr(const iterm_cell_t *cell)
 {
-	cchar_t wc;
-	wchar_t wstr[MAX_CELL_CHARS + 1];
-	attr_t n_attrs = A_NORMAL;
+	attr_t a = A_NORMAL;
 
 	// Attrmap
-	if (attrs.attrs.bold)
-		n_attrs |= A_BOLD;
-	if (attrs.attrs.underline)
-		n_attrs |= A_UNDERLINE;
-	if (attrs.attrs.reverse)
-		n_attrs |= A_REVERSE;
-	if (attrs.attrs.blink)
-		n_attrs |= A_BLINK;
-
-	if (chars[0] == 0) {
-		wstr[0] = L' ';
-		wstr[1] = L'\0';
-	} else {
-		int i;
-		for (i = 0; i < MAX_CELL_CHARS && chars[i]; i++)
-			wstr[i] = (wchar_t)chars[i];
-		wstr[i] = L'\0';
+	if (cell->attrs.bold)
+		a |= A_BOLD;
+	if (cell->attrs.underline)
+		a |= A_UNDERLINE;
+	if (cell->attrs.reverse)
+		a |= A_REVERSE;
+	if (cell->attrs.blink)
+		a |= A_BLINK;
+	return a;
+}
+
+static int blit_reserve(iterm_t *self, int n)
+{
+	cchar_t *line;
+	iterm_cell_t *cells;
+
+	if (n <= self->blit_cap)
+		return 0;
+
+	line = realloc(self->blit, sizeof(cchar_t) * n);
+	if (!line)
+		return -1;
+	self->blit = line;
+
+	cells = realloc(self->row_cells, sizeof(iterm_cell_t) * n);
+	if (!cells)
+		return -1;
+	self->row_cells = cells;
+
+	self->blit_cap = n;
+	return 0;
+}
+
+/**
+ * blit_row - Emit @n cells at viewport (@y, @x) with one mvwadd_wchnstr
+ * Cells are converted in runs sharing attributes and colours: the pair
+ * and template are only looked up when the run changes, and an ASCII
+ * cell is a copy of the template with its glyph patched in.
+ * @cursor: index of the cell drawn as the cursor, -1 for none
+ */
+static void blit_row(cosh_win_t *win, iterm_t *self, int y, int x,
+		     const iterm_cell_t *cells, int n, int cursor)
+{
+	cchar_t tmpl;
+	attr_t run_attr = A_NORMAL;
+	int run_fg = 0, run_bg = 0, run_pair = -1;
+	int len = 0;
+
+	/* the left half of a wide character is outside the range */
+	while (n > 0 && cells[0].chars[0] == CELL_WIDE_CONT) {
+		cells++;
+		n--;
+		x++;
+		cursor--;
+	}
+
+	if (n <= 0 || blit_reserve(self, n) != 0)
+		return;
+
+	for (int i = 0; i < n; i++) {
+		const iterm_cell_t *c = &cells[i];
+		attr_t a = cell_attr(c);
+		uint32_t ch = c->chars[0];
+
+		/* covered by the wide character before it */
+		if (ch == CELL_WIDE_CONT)
+			continue;
+
+		if (run_pair < 0 || i == cursor || run_pair == CP_CURSOR ||
+		    a != run_attr || c->fg != run_fg || c->bg != run_bg) {
+			run_pair = (i == cursor) ? CP_CURSOR :
+			    get_pair(self, c->fg, c->bg);
+			run_attr = a;
+			run_fg = c->fg;
+			run_bg = c->bg;
+			win_setcchar(&tmpl, L" ", a, run_pair);
+		}
+
+		if (ch < 0x80 && c->chars[1] == 0) {
+			self->blit[len] = tmpl;
+			if (ch >= 0x20)
+				CCHAR_SET_ASCII(&self->blit[len], ch, a, run_pair);
+		} else {
+			wchar_t wstr[MAX_CELL_CHARS + 1];
+			int k;
+
+			for (k = 0; k < MAX_CELL_CHARS && c->chars[k]; k++)
+				wstr[k] = (wchar_t)c->chars[k];
+			wstr[k] = L'\0';
+			win_setcchar(&self->blit[len], wstr, a, run_pair);
+		}
+		len++;
 	}
 
-	if (setcchar(&wc, wstr, n_attrs, (short)pair, NULL) == OK)
-		mvwadd_wch(w, y, x, &wc);
+	mvwadd_wchnstr(win->ptr, y + 1, x + 2, self->blit, len);
 }
 
-void app_iterm_render(cosh_win_t *win)
+/**
+ * screen_cell - Read a cell of the visible screen
+ * From the published snapshot in ITERM_IO_PARSER mode, from vterm otherwise.
+ */
+static int screen_cell(iterm_t *self, const iterm_snap_t *snap, VTermPos pos,
+		       iterm_cell_t *out)
+{
+	VTermScreenCell cell;
+
+	if (snap) {
+		if (pos.row >= snap->rows || pos.col >= snap->cols)
+			return 0;
+		*out = snap->cells[pos.row * snap->cols + pos.col];
+		return 1;
+	}
+
+	if (!vterm_screen_get_cell(self->vts, pos, &cell))
+		return 0;
+
+	cell_pack(out, &cell);
+	return 1;
+}
+
+/**
+ * render_screen - Draw screen rows [@r0, @r1) and columns [@c0, @c1)
+ * @off: window rows taken by history above the screen
+ */
+static void render_screen(cosh_win_t *win, iterm_t *self,
+			  const iterm_snap_t *snap, VTermPos cur, int off,
+			  int r0, int r1, int c0, int c1)
+{
+	VTermPos pos;
+	int vy0, vy1;
+
+	/* rows hidden behind other windows are left to the WM's stale mark */
+	win_visible_rows(win, &vy0, &vy1);
+	if (r0 < vy0 - off)
+		r0 = vy0 - off;
+	if (r1 > vy1 - off)
+		r1 = vy1 - off;
+	if (c0 < 0)
+		c0 = 0;
+	if (c1 > win->vw)
+		c1 = win->vw;
+	if (snap) {
+		if (r1 > snap->rows)
+			r1 = snap->rows;
+		if (c1 > snap->cols)
+			c1 = snap->cols;
+	}
+	if (c0 >= c1 || blit_reserve(self, c1 - c0) != 0)
+		return;
+
+	for (pos.row = (r0 > 0) ? r0 : 0; pos.row < r1; pos.row++) {
+		const iterm_cell_t *cells;
+		int cursor = (off == 0 && pos.row == cur.row) ? cur.col - c0 : -1;
+
+		if (snap) {
+			cells = &snap->cells[pos.row * snap->cols + c0];
+		} else {
+			for (pos.col = c0; pos.col < c1; pos.col++) {
+				iterm_cell_t *dst = &self->row_cells[pos.col - c0];
+
+				if (!screen_cell(self, NULL, pos, dst))
+					memset(dst, 0, sizeof(*dst));
+			}
+			cells = self->row_cells;
+		}
+
+		blit_row(win, self, pos.row + off, c0, cells, c1 - c0, cursor);
+		if (cursor >= 0 && cursor < c1 - c0)
+			self->cur_drawn = cur;
+	}
+}
+
+/**
+ * iterm_scroll - Scroll what the window shows instead of repainting it
+ * The cursor drawn before moves too, its new place is damaged. If the
+ * window cannot scroll in place the whole region is damaged.
+ */
+static void iterm_scroll(cosh_win_t *win, iterm_t *self,
+			 const iterm_scroll_t *sc, iterm_damage_t *dmg, int cols)
+{
+	VTermPos *cd = &self->cur_drawn;
+
+	if (win_scroll(win, sc->top, sc->bottom - sc->top, sc->n) != 0) {
+		damage_add(dmg, (VTermRect) {
+			   .start_row = sc->top,.end_row = sc->bottom,
+			   .start_col = 0,.end_col = cols});
+		return;
+	}
+
+	if (cd->row < sc->top || cd->row >= sc->bottom)
+		return;
+
+	cd->row -= sc->n;
+	if (cd->row < sc->top || cd->row >= sc->bottom) {
+		cd->row = -1;
+		return;
+	}
+
+	damage_add(dmg, (VTermRect) {
+		   .start_row = cd->row,.end_row = cd->row + 1,
+		   .start_col = cd->col,.end_col = cd->col + 1});
+}
+
+/**
+ * iterm_render - Paint the viewport, or only the damage when @partial
+ */
+static void iterm_render(cosh_win_t *win, int partial)
 {
 	iterm_t *self = (iterm_t *) win->priv;
 	if (!self || !win->ptr)
@@ -488,99 +2038,95 @@ void app_iterm_render(cosh_win_t *win)
 
 	int rows = win->vh;
 	int cols = win->vw;
-
+	const iterm_snap_t *snap = NULL;
+	iterm_damage_t dmg = { .count = 0 };
+	iterm_scroll_t sc = { .n = 0 };
 	VTermPos cur;
-	vterm_state_get_cursorpos(vterm_obtain_state(self->vt), &cur);
+	int altscreen;
 
-	if (self->is_altscreen) {
+	int scroll_offset = win->scroll_max - win->scroll_cur;
+	if (scroll_offset < 0)
+		scroll_offset = 0;
+
+	/* history is read under the vt lock, taken before the snap lock */
+	int locked = scroll_offset > 0;
+	if (locked)
+		iterm_lock(self);
+
+	if (self->io_mode == ITERM_IO_PARSER) {
+		pthread_mutex_lock(&self->snap_lock);
+		snap = &self->snap[self->snap_front];
+		cur = snap->cursor;
+		altscreen = snap->altscreen;
+		scroll_take(&sc, &dmg, &self->scroll_ready, &self->damage_ready,
+			    cols);
+	} else {
+		vterm_state_get_cursorpos(vterm_obtain_state(self->vt), &cur);
+		altscreen = self->is_altscreen;
+		scroll_take(&sc, &dmg, &self->scroll, &self->damage, cols);
+	}
+
+	if (altscreen) {
 		win->scroll_max = 0;
 		win->scroll_cur = 0;
+		scroll_offset = 0;
+	}
 
-		for (int r = 0; r < rows; r++) {
-			for (int c = 0; c < cols; c++) {
-				VTermPos pos = {.row = r,.col = c };
-				VTermScreenCell cell;
-
-				if (vterm_screen_get_cell
-				    (self->vts, pos, &cell)) {
-					int p = (r == cur.row
-						 && c ==
-						 cur.col) ? CP_CURSOR :
-					    get_pair(self,
-						     get_color_idx(cell.fg),
-						     get_color_idx(cell.bg));
-
-					win_attron(win, p);
-					draw_cell(win->ptr, r + 1, c + 2,
-						  cell.chars, p, cell);
-					win_attroff(win, p);
-				}
-			}
-		}
-
-		return;		/* early return */
+	/*
+	 * Our list may have grown since the WM rect was marked, it is always
+	 * a superset of that rect, so paint the list.
+	 */
+	if (partial && scroll_offset == 0) {
+		if (sc.n)
+			iterm_scroll(win, self, &sc, &dmg, cols);
+		for (int i = 0; i < dmg.count; i++)
+			render_screen(win, self, snap, cur, 0,
+				      dmg.rect[i].start_row, dmg.rect[i].end_row,
+				      dmg.rect[i].start_col, dmg.rect[i].end_col);
+		goto out;
 	}
 
-	win->scroll_max = self->hist_cnt;
-	int scroll_offset =
-	    self->is_altscreen ? 0 : (self->hist_cnt - win->scroll_cur);
-	if (scroll_offset < 0)
-		scroll_offset = 0;
+	/* Render from History */
+	int vy0, vy1;
+	win_visible_rows(win, &vy0, &vy1);
+	for (int r = vy0; r < vy1 && r < rows && r < scroll_offset; r++) {
+		iterm_line_t *l = c_hist_get(&self->hist, scroll_offset - r - 1);
+		int n;
 
-	for (int r = 0; r < rows; r++) {
-		if (!self->is_altscreen && r < scroll_offset) {
-			/* Render from History */
-			int hidx =
-			    (self->hist_head - (scroll_offset - r) + 1 +
-			     HIST_SIZE) % HIST_SIZE;
-			iterm_line_t *l = &self->history[hidx];
-
-			if (l && l->cells) {
-				for (int c = 0; c < cols && c < l->cols; c++) {
-					int p = get_pair(self, l->cells[c].fg,
-							 l->cells[c].bg);
-
-					VTermScreenCell tmp_cell = { 0 };
-					memcpy(tmp_cell.chars,
-					       l->cells[c].chars,
-					       sizeof(tmp_cell.chars));
-					tmp_cell.attrs = l->cells[c].attrs;
-
-					win_attron(win, p);
-					draw_cell(win->ptr, r + 1, c + 2,
-						  l->cells[c].chars, p,
-						  tmp_cell);
-					win_attroff(win, p);
-				}
-			}
+		if (!l)
 			continue;
-		}
 
-		/* Render Active Screen */
-		VTermPos pos = {.row =
-			    self->is_altscreen ? r : (r - scroll_offset),.col =
-			    0
-		};
-		for (pos.col = 0; pos.col < cols; pos.col++) {
-			VTermScreenCell cell;
-			if (vterm_screen_get_cell(self->vts, pos, &cell)) {
-				int p;
-				if (scroll_offset == 0 && pos.row == cur.row
-				    && pos.col == cur.col) {
-					p = CP_CURSOR;
-				} else {
-					p = get_pair(self,
-						     get_color_idx(cell.fg),
-						     get_color_idx(cell.bg));
-				}
-
-				win_attron(win, p);
-				draw_cell(win->ptr, r + 1, pos.col + 2,
-					  cell.chars, p, cell);
-				win_attroff(win, p);
-			}
-		}
+		n = (l->cols < cols) ? l->cols : cols;
+		if (blit_reserve(self, n) != 0)
+			continue;
+
+		for (int i = 0; i < n; i++)
+			hcell_unpack(&self->row_cells[i], l, i);
+		if (self->find.active && self->find.len > 0)
+			find_mark(self, l, self->hist_seq - scroll_offset + r,
+				  self->row_cells, n);
+		blit_row(win, self, r, 0, self->row_cells, n, -1);
 	}
+
+	/* Render Active Screen */
+	render_screen(win, self, snap, cur, scroll_offset, 0, rows, 0, cols);
+
+ out:
+	if (snap)
+		pthread_mutex_unlock(&self->snap_lock);
+	if (locked)
+		iterm_unlock(self);
+}
+
+void app_iterm_render(cosh_win_t *win)
+{
+	iterm_render(win, 0);
+}
+
+void app_iterm_render_rect(cosh_win_t *win, win_rect_t rect)
+{
+	(void)rect;
+	iterm_render(win, 1);
 }
 
 void iterm_cleanup(void *p)
@@ -589,28 +2135,49 @@ void iterm_cleanup(void *p)
 	if (!self)
 		return;
 
-	if (self->active && self->pid > 0) {
-		kill(self->pid, SIGHUP);
-		usleep(1000);
-		kill(self->pid, SIGKILL);
-		waitpid(self->pid, NULL, WNOHANG);
-	}
+	/* does not block, the SIGCHLD handler reaps it */
+	if (self->pid > 0)
+		c_proc_terminate(self->pid, HANGUP_GRACE_MS);
 
-	if (self->history) {
-		for (int i = 0; i < HIST_SIZE; i++)
-			free_line(&self->history[i]);
-		free(self->history);
-	}
+	iterm_stop_reader(self);
+
+	c_hist_free(&self->hist);
+	c_find_idx_free(&self->find_idx);
+	free(self->find_text);
+	free(self->find_col);
 
 	if (self->vt)
 		vterm_free(self->vt);
 
+	free(self->blit);
+	free(self->row_cells);
+	tx_free(self);
+	if (self->tx_fd >= 0)
+		close(self->tx_fd);
 	if (self->fd >= 0)
 		close(self->fd);
 
+	pthread_mutex_destroy(&self->vt_lock);
+	pthread_mutex_destroy(&self->snap_lock);
 	free(self);
 }
 
+/**
+ * hist_spill_open - Scrollback past the limits goes to the workdir
+ * The pid in the name only keeps sessions creating theirs at the same
+ * time apart, the files are unlinked once open.
+ */
+static void hist_spill_open(iterm_t *self)
+{
+	static unsigned int seq;
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/scrollback-%d-%u", WORKDIR,
+		     (int)getpid(), seq++) >= (int)sizeof(path) ||
+	    c_hist_spill(&self->hist, path) != 0)
+		c_log_warn("Terminal scrollback stays in memory.");
+}
+
 void win_spawn_iterm(void)
 {
 	cosh_win_t *win = win_create(40, 80, WIN_FLAG_NONE);
@@ -624,23 +2191,50 @@ void win_spawn_iterm(void)
 	self->vt = vterm_new(win->vh, win->vw);
 	vterm_set_utf8(self->vt, 1);
 	self->vts = vterm_obtain_screen(self->vt);
-	self->history = calloc(HIST_SIZE, sizeof(iterm_line_t));
+	if (c_hist_init(&self->hist, wm.configs.terminal.scrollback,
+			(size_t)wm.configs.terminal.scrollback_kb * 1024) != 0)
+		c_log_warn("Terminal has no scrollback.");
+	else if (wm.configs.terminal.scrollback_spill)
+		hist_spill_open(self);
 	self->fd = -1;
-
-	vterm_screen_set_callbacks(self->vts, &screen_cbs, win);
+	self->tx_fd = -1;
+	self->cur_drawn.row = -1;
+	self->win = win;
+	pthread_mutex_init(&self->vt_lock, NULL);
+	pthread_mutex_init(&self->snap_lock, NULL);
+
+	vterm_screen_set_callbacks(self->vts, &screen_cbs, self);
+	vterm_output_set_callback(self->vt, cb_output, self);
 	vterm_screen_reset(self->vts, 1);
 
 	iterm_spawn(self, win);
-	win->poll_fd = self->fd;
 
 	win_setopt(win, WIN_OPT_PRIV, self);
 	win_setopt(win, WIN_OPT_APPNAME, "Terminal");
 	win_setopt(win, WIN_OPT_TITLE, "Terminal");
 	win_setopt(win, WIN_OPT_RENDER, app_iterm_render);
+	win_setopt(win, WIN_OPT_RENDER_RECT, app_iterm_render_rect);
 	win_setopt(win, WIN_OPT_INPUT, app_iterm_input);
 	win_setopt(win, WIN_OPT_FG, COLOR_WHITE);
 	win_setopt(win, WIN_OPT_BG, COLOR_BLACK);
 	win_setopt(win, WIN_OPT_TICK, app_iterm_tick);
+
+	/* its own fd number, the pty fd is already registered for reading */
+	if (self->active) {
+		self->tx_fd = fcntl(self->fd, F_DUPFD_CLOEXEC, 0);
+		self->tx_watch = win_watch(win, self->tx_fd, EPOLLET,
+					   iterm_on_writable);
+		if (!self->tx_watch)
+			self->active = 0;
+	}
+
+	if (self->active && wm.configs.terminal.threaded_io &&
+	    iterm_start_reader(self, wm.configs.terminal.threaded_io,
+			       win->vh, win->vw) == 0)
+		win_setopt(win, WIN_OPT_POLLFD, self->notify_fd);
+	else
+		win_setopt(win, WIN_OPT_POLLFD, self->fd);
+
 	win_setopt(win, WIN_OPT_DESTROY, iterm_cleanup);
 	win_setopt(win, WIN_OPT_RESIZE, iterm_sync_size);
 	win_setopt(win, WIN_OPT_CURSOR, 0);
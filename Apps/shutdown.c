@@ -7,36 +7,53 @@ void app_shutdown_render(cosh_win_t *win)
 	mvwprintw(win->ptr, 3, (win->w - 22) / 2, "Press [y] Yes | [n] No");
 }
 
-void confirm_shutdown(void)
+static cosh_win_t *dialog = NULL;
+
+static void app_shutdown_input(cosh_win_t *win, int ch, MEVENT *ev)
 {
-	int h = 6; int w = 40;
-	cosh_win_t *dlg = win_create(h, w, WIN_FLAG_LOCKED);
-	if (!dlg)
-		return;
+	(void)ev;
 
-	win_setopt(dlg, WIN_OPT_TITLE, "System Alert");
-	win_setopt(dlg, WIN_OPT_RENDER, app_shutdown_render);
-	win_setopt(dlg, WIN_OPT_BG, COLOR_BLUE);
+	if (ch == 'y' || ch == 'Y')
+		win_modal_done(win, 1);
+	else if (ch == 'n' || ch == 'N' || ch == 27)
+		win_modal_done(win, 0);
+}
 
-	dlg->y = (LINES - h) / 2;
-	dlg->x = (COLS - w) / 2;
-	mvwin(dlg->ptr, dlg->y, dlg->x);
+static void shutdown_result(int result, void *data)
+{
+	(void)data;
 
-	win_vibrate();
+	dialog = NULL;
+	if (result == 1)
+		c_shutdown();
+}
+
+/**
+ * confirm_shutdown - Ask before shutting down
+ * The dialog is modal, the event loop and every terminal keep running.
+ */
+void confirm_shutdown(void)
+{
+	int h = 6; int w = 40;
 
-	while (1) {
-		win_refresh_all();
-		int ch = wgetch(dlg->ptr);
-		if (ch == 'y' || ch == 'Y') {
-			c_shutdown();
-			break;
-		}
-		if (ch == 'n' || ch == 'N' || ch == 27) {
-			break;
-		}
+	if (dialog) {
+		win_vibrate();
+		return;
 	}
 
-	win_destroy_focused();
-}
+	dialog = win_create(h, w, WIN_FLAG_LOCKED);
+	if (!dialog)
+		return;
+
+	win_setopt(dialog, WIN_OPT_TITLE, "System Alert");
+	win_setopt(dialog, WIN_OPT_RENDER, app_shutdown_render);
+	win_setopt(dialog, WIN_OPT_INPUT, app_shutdown_input);
+	win_setopt(dialog, WIN_OPT_BG, COLOR_BLUE);
 
+	dialog->y = (LINES - h) / 2;
+	dialog->x = (COLS - w) / 2;
+	move_panel(dialog->panel, dialog->y, dialog->x);
 
+	win_setopt(dialog, WIN_OPT_MODAL, shutdown_result, NULL);
+	win_vibrate();
+}
@@ -0,0 +1,285 @@
+/*
+ * blit - Cells per second of the terminal row renderer
+ *
+ * Renders a synthetic full-screen htop-style frame (meters, a header and
+ * a colourful process list with a selected row) into a curses WINDOW,
+ * once the old way with setcchar/mvwadd_wch and attron/attroff per cell
+ * and once the way Apps/iterm.c blit_row() does, a run-grouped row
+ * emitted with one mvwadd_wchnstr. Output goes to /dev/null, only the
+ * WINDOW updates are timed.
+ *
+ *   make bench && Build/bench-blit [rows cols frames]
+ */
+#define _XOPEN_SOURCE_EXTENDED
+#define _POSIX_C_SOURCE 200809L
+
+#include <curses.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#define MAX_CELL_CHARS	6
+
+typedef struct {
+	uint32_t chars[MAX_CELL_CHARS];
+	int fg, bg;
+	int bold, underline, reverse, blink;
+} cell_t;
+
+static int pairs[257][257];
+static int npairs = 1;
+
+static int get_pair(int fg, int bg)
+{
+	int *p = &pairs[fg + 1][bg + 1];
+
+	if (!*p && npairs < COLOR_PAIRS) {
+		init_pair((short)npairs, (short)fg, (short)bg);
+		*p = npairs++;
+	}
+	return *p;
+}
+
+static inline attr_t cell_attr(const cell_t *c)
+{
+	attr_t a = A_NORMAL;
+
+	if (c->bold)
+		a |= A_BOLD;
+	if (c->underline)
+		a |= A_UNDERLINE;
+	if (c->reverse)
+		a |= A_REVERSE;
+	if (c->blink)
+		a |= A_BLINK;
+	return a;
+}
+
+/* Old path: one setcchar and mvwadd_wch per cell */
+
+static void draw_cell(WINDOW *w, int y, int x, const cell_t *cell, int pair)
+{
+	cchar_t wc;
+	wchar_t wstr[MAX_CELL_CHARS + 1];
+	int i;
+
+	if (cell->chars[0] == 0) {
+		wstr[0] = L' ';
+		wstr[1] = L'\0';
+	} else {
+		for (i = 0; i < MAX_CELL_CHARS && cell->chars[i]; i++)
+			wstr[i] = (wchar_t)cell->chars[i];
+		wstr[i] = L'\0';
+	}
+
+	if (setcchar(&wc, wstr, cell_attr(cell), (short)pair, NULL) == OK)
+		mvwadd_wch(w, y, x, &wc);
+}
+
+static void render_cells(WINDOW *w, const cell_t *cells, int rows, int cols)
+{
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < cols; x++) {
+			const cell_t *c = &cells[y * cols + x];
+			int p = get_pair(c->fg, c->bg);
+
+			wattron(w, COLOR_PAIR(p));
+			draw_cell(w, y, x, c, p);
+			wattroff(w, COLOR_PAIR(p));
+		}
+	}
+}
+
+/* New path: as blit_row() in Apps/iterm.c */
+
+static void blit_row(WINDOW *w, cchar_t *line, int y, const cell_t *cells,
+		     int n)
+{
+	cchar_t tmpl;
+	attr_t run_attr = A_NORMAL;
+	int run_fg = 0, run_bg = 0, run_pair = -1;
+
+	for (int i = 0; i < n; i++) {
+		const cell_t *c = &cells[i];
+		attr_t a = cell_attr(c);
+		uint32_t ch = c->chars[0];
+
+		if (run_pair < 0 || a != run_attr || c->fg != run_fg ||
+		    c->bg != run_bg) {
+			run_pair = get_pair(c->fg, c->bg);
+			run_attr = a;
+			run_fg = c->fg;
+			run_bg = c->bg;
+			setcchar(&tmpl, L" ", a, (short)run_pair, NULL);
+		}
+
+		line[i] = tmpl;
+		if (ch < 0x80 && c->chars[1] == 0) {
+			if (ch >= 0x20)
+				line[i].chars[0] = (wchar_t)ch;
+		} else {
+			wchar_t wstr[MAX_CELL_CHARS + 1];
+			int k;
+
+			for (k = 0; k < MAX_CELL_CHARS && c->chars[k]; k++)
+				wstr[k] = (wchar_t)c->chars[k];
+			wstr[k] = L'\0';
+			setcchar(&line[i], wstr, a, (short)run_pair, NULL);
+		}
+	}
+
+	mvwadd_wchnstr(w, y, 0, line, n);
+}
+
+static void render_rows(WINDOW *w, cchar_t *line, const cell_t *cells,
+			int rows, int cols)
+{
+	for (int y = 0; y < rows; y++)
+		blit_row(w, line, y, &cells[y * cols], cols);
+}
+
+/* Workload */
+
+static void put(cell_t *row, int cols, int *x, const char *s, int fg, int bg,
+		int bold)
+{
+	for (; *s && *x < cols; s++, (*x)++) {
+		cell_t *c = &row[*x];
+
+		memset(c, 0, sizeof(*c));
+		c->chars[0] = (unsigned char)*s;
+		c->fg = fg;
+		c->bg = bg;
+		c->bold = bold;
+	}
+}
+
+/* one htop frame, @seed moves the meters and the process list */
+static void frame_build(cell_t *cells, int rows, int cols, unsigned int seed)
+{
+	static const int meter_fg[] = { 2, 1, 4, 6, 3 };
+	char buf[256];
+
+	srand(seed);
+	for (int y = 0; y < rows; y++) {
+		cell_t *row = &cells[y * cols];
+		int x = 0;
+
+		if (y < rows / 4) {
+			int fill = rand() % 40;
+
+			snprintf(buf, sizeof(buf), "%3d", y);
+			put(row, cols, &x, buf, 6, -1, 0);
+			put(row, cols, &x, "[", 7, -1, 1);
+			for (int i = 0; i < 40; i++)
+				put(row, cols, &x, i < fill ? "|" : " ",
+				    meter_fg[i % 5], -1, 0);
+			snprintf(buf, sizeof(buf), "%5.1f%%]", fill * 2.5);
+			put(row, cols, &x, buf, 7, -1, 1);
+		} else if (y == rows / 4) {
+			put(row, cols, &x,
+			    "    PID USER      PRI  NI  VIRT   RES   SHR S CPU% MEM%   TIME+  Command",
+			    0, 2, 0);
+		} else {
+			int sel = (y == rows / 2);
+			int bg = sel ? 6 : -1;
+
+			snprintf(buf, sizeof(buf), "%7d ", 1000 + rand() % 90000);
+			put(row, cols, &x, buf, sel ? 0 : -1, bg, 0);
+			put(row, cols, &x, "user      ", sel ? 0 : 3, bg, 0);
+			snprintf(buf, sizeof(buf), " 20   0 %5dM %5dM ", rand() % 9000,
+				 rand() % 900);
+			put(row, cols, &x, buf, sel ? 0 : -1, bg, 0);
+			snprintf(buf, sizeof(buf), "%5dK S ", rand() % 90000);
+			put(row, cols, &x, buf, sel ? 0 : 8, bg, 0);
+			snprintf(buf, sizeof(buf), "%4.1f %4.1f ", (rand() % 1000) / 10.0,
+				 (rand() % 100) / 10.0);
+			put(row, cols, &x, buf, sel ? 0 : 2, bg, 1);
+			snprintf(buf, sizeof(buf), "%2d:%02d.%02d ", rand() % 60, rand() % 60,
+				 rand() % 100);
+			put(row, cols, &x, buf, sel ? 0 : -1, bg, 0);
+			put(row, cols, &x, "/usr/bin/", sel ? 0 : 8, bg, 0);
+			put(row, cols, &x, "process --with --some arguments", sel ? 0 : 4,
+			    bg, 1);
+		}
+
+		while (x < cols) {
+			memset(&row[x], 0, sizeof(cell_t));
+			row[x].fg = -1;
+			row[x++].bg = (y > rows / 4 && y == rows / 2) ? 6 : -1;
+		}
+	}
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int rows = (argc > 1) ? atoi(argv[1]) : 50;
+	int cols = (argc > 2) ? atoi(argv[2]) : 200;
+	int frames = (argc > 3) ? atoi(argv[3]) : 500;
+	FILE *out = fopen("/dev/null", "w");
+	SCREEN *scr;
+	WINDOW *w;
+	cell_t *cells[8];
+	cchar_t *line;
+	double t, t_old, t_new;
+
+	if (rows <= 0 || cols <= 0 || frames <= 0 || !out) {
+		fprintf(stderr, "usage: %s [rows cols frames]\n", argv[0]);
+		return 1;
+	}
+
+	scr = newterm("xterm-256color", out, stdin);
+	if (!scr) {
+		fprintf(stderr, "no xterm-256color terminfo entry\n");
+		return 1;
+	}
+	start_color();
+	use_default_colors();
+
+	w = newwin(rows, cols, 0, 0);
+	line = malloc(sizeof(cchar_t) * cols);
+	for (int i = 0; i < 8; i++) {
+		cells[i] = malloc(sizeof(cell_t) * rows * cols);
+		if (!cells[i])
+			return 1;
+		frame_build(cells[i], rows, cols, (unsigned int)i + 1);
+	}
+	if (!w || !line)
+		return 1;
+
+	/* warm the pair table and the WINDOW */
+	render_cells(w, cells[0], rows, cols);
+	render_rows(w, line, cells[0], rows, cols);
+
+	t = now_sec();
+	for (int f = 0; f < frames; f++)
+		render_cells(w, cells[f & 7], rows, cols);
+	t_old = now_sec() - t;
+
+	t = now_sec();
+	for (int f = 0; f < frames; f++)
+		render_rows(w, line, cells[f & 7], rows, cols);
+	t_new = now_sec() - t;
+
+	endwin();
+	delscreen(scr);
+
+	printf("%dx%d, %d frames, %d pairs\n", cols, rows, frames, npairs - 1);
+	printf("per cell   %8.2f Mcells/s\n",
+	       (double)rows * cols * frames / t_old / 1e6);
+	printf("per row    %8.2f Mcells/s\n",
+	       (double)rows * cols * frames / t_new / 1e6);
+	printf("speedup    %8.2fx\n", t_old / t_new);
+	return 0;
+}
@@ -4,8 +4,29 @@
 /* Config Management */
 
 static const config_item desktop_items[] = {
-	CFG_INT("refresh_rate", "Refresh rate in milliseconds",
-		&wm.configs.desktop.refresh_rate, "800")
+	CFG_INT("refresh_rate", "Statusbar refresh rate in milliseconds",
+		&wm.configs.desktop.refresh_rate, "1000"),
+	CFG_INT("max_fps", "Redraw at most this many frames per second (0 is uncapped)",
+		&wm.configs.desktop.max_fps, "60"),
+	CFG_INT("compositor", "0 ncurses panels, 1 native cell grid",
+		&wm.configs.desktop.compositor, "0"),
+	CFG_INT("sync_update", "Synchronized frame updates (-1 ask terminfo, 0 off, 1 on)",
+		&wm.configs.desktop.sync_update, "-1")
+};
+
+static const config_item terminal_items[] = {
+	CFG_INT("threaded_io", "0 inline, 1 reader thread, 2 reader and parser thread",
+		&wm.configs.terminal.threaded_io, "0"),
+	CFG_INT("io_budget", "Bytes a terminal may parse per frame",
+		&wm.configs.terminal.io_budget, "65536"),
+	CFG_INT("io_time", "Microseconds a terminal may parse per frame",
+		&wm.configs.terminal.io_time, "4000"),
+	CFG_INT("scrollback", "Scrollback lines per terminal (0 is no limit)",
+		&wm.configs.terminal.scrollback, "10000"),
+	CFG_INT("scrollback_kb", "Scrollback memory per terminal in KiB (0 is no limit)",
+		&wm.configs.terminal.scrollback_kb, "0"),
+	CFG_INT("scrollback_spill", "Keep lines past the limits above in a workdir file (0 off, 1 on)",
+		&wm.configs.terminal.scrollback_spill, "0")
 };
 
 static const config_item key_items[] = {
@@ -15,6 +36,7 @@ static const config_item key_items[] = {
 	CFG_STR("win_mv_right", "Move focused window right", &wm.configs.keys.win_mv_right, "l"),
 	CFG_STR("win_mv_left", "Move focused window left", &wm.configs.keys.win_mv_left, "h"),
 	CFG_STR("toggle_fullscreen", "The current defaukt is MOD + F (Basicly Alt + F)", &wm.configs.keys.tog_fullscr, "f"),
+	CFG_STR("find", "Search the focused window, MOD + /", &wm.configs.keys.find, "/"),
 };
 
 static const config_item color_items[] = {
@@ -37,6 +59,12 @@ static const config_section app_config[] = {
 	 desktop_items,
 	 sizeof(desktop_items) / sizeof(desktop_items[0])
 	 },
+	{
+	 "terminal",
+	 "Terminal emulator I/O",
+	 terminal_items,
+	 sizeof(terminal_items) / sizeof(terminal_items[0])
+	 },
 	{
 	 "keys",
 	 "Adjust your key shortcut here",
@@ -44,6 +44,14 @@ int c_boot(void)
 		return -1;
 	}
 
+	c_log_trace("Preparing event loop...");
+	if (c_loop_init() != 0)
+		return -1;
+
+	c_log_trace("Routing signals...");
+	if (c_proc_init() != 0)
+		return -1;
+
 	if (lstat(CONFIGFILE, &sb) != 0) {
 		c_log_trace("Creating default config...", CONFIGFILE);
 		generate_default_config();
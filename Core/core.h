@@ -2,6 +2,7 @@
 #define CORE_H
 
 #include "log.h"
+#include "proc.h"
 #include "../wmcurses.h"
 #include "../util.h"
 #include "XDGPATH.h"
@@ -0,0 +1,220 @@
+#include "find.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FIND_WORDS	(FIND_BITS / 64)
+#define FIND_RING_MIN	64	/* blocks before the ring first grows */
+#define FIND_RING_MAX	4096	/* 4 MiB of filters, 256k lines */
+
+/* eight code points compared at once */
+typedef uint32_t find_v8_t __attribute__((vector_size(32)));
+
+static inline uint64_t *idx_block(const c_find_idx_t *idx, uint64_t block)
+{
+	return idx->bits + (block % (uint64_t)idx->cap) * FIND_WORDS;
+}
+
+void c_find_idx_free(c_find_idx_t *idx)
+{
+	free(idx->bits);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * c_find_idx_reset - Forget every line, numbering starts over at 0
+ */
+void c_find_idx_reset(c_find_idx_t *idx)
+{
+	idx->first = idx->next = 0;
+}
+
+/*
+ * Room for one more block, the ring keeps its oldest first. A full
+ * ring of FIND_RING_MAX forgets its oldest block, lines past the index
+ * are always scanned.
+ */
+static int idx_grow(c_find_idx_t *idx)
+{
+	int cap = idx->cap ? idx->cap * 2 : FIND_RING_MIN;
+	uint64_t *bits;
+
+	if (idx->next - idx->first < (uint64_t)idx->cap)
+		return 0;
+
+	if (idx->cap >= FIND_RING_MAX) {
+		idx->first++;
+		return 0;
+	}
+
+	bits = malloc(sizeof(uint64_t) * FIND_WORDS * cap);
+	if (!bits)
+		return -1;
+
+	for (uint64_t b = idx->first; b < idx->next; b++)
+		memcpy(bits + (b % (uint64_t)cap) * FIND_WORDS,
+		       idx_block(idx, b), sizeof(uint64_t) * FIND_WORDS);
+
+	free(idx->bits);
+	idx->bits = bits;
+	idx->cap = cap;
+	return 0;
+}
+
+/* hash of the trigram at @s, 0 for a blank one */
+static inline uint64_t trigram_key(const uint32_t *s)
+{
+	uint64_t a = c_find_fold(s[0]), b = c_find_fold(s[1]);
+	uint64_t c = c_find_fold(s[2]);
+	uint64_t h;
+
+	if (b <= ' ' && (a <= ' ' || c <= ' '))
+		return 0;
+
+	h = (a << 42) ^ (b << 21) ^ c;
+	h *= 0x9E3779B97F4A7C15ull;
+	return (h ^ (h >> 29)) | 1;
+}
+
+/* two bits of a filter per key */
+static inline void key_bits(uint64_t key, int *b0, int *b1)
+{
+	*b0 = (int)key & (FIND_BITS - 1);
+	*b1 = (int)(key >> 32) & (FIND_BITS - 1);
+}
+
+/**
+ * c_find_idx_add - Index the @n code points of line @line
+ * Lines come in ascending order, blocks skipped over stay empty.
+ */
+int c_find_idx_add(c_find_idx_t *idx, uint64_t line, const uint32_t *s, int n)
+{
+	uint64_t block = line / FIND_BLOCK;
+	uint64_t *bits;
+
+	if (block < idx->first)
+		return 0;
+
+	while (idx->next <= block) {
+		if (idx_grow(idx) != 0)
+			return -1;
+		memset(idx_block(idx, idx->next), 0,
+		       sizeof(uint64_t) * FIND_WORDS);
+		idx->next++;
+	}
+
+	bits = idx_block(idx, block);
+	for (int i = 0; i + 3 <= n; i++) {
+		uint64_t key = trigram_key(s + i);
+		int b0, b1;
+
+		if (!key)
+			continue;
+
+		key_bits(key, &b0, &b1);
+		bits[b0 >> 6] |= 1ull << (b0 & 63);
+		bits[b1 >> 6] |= 1ull << (b1 & 63);
+	}
+	return 0;
+}
+
+/**
+ * c_find_idx_trim - Drop the blocks that end before line @oldest
+ */
+void c_find_idx_trim(c_find_idx_t *idx, uint64_t oldest)
+{
+	uint64_t block = oldest / FIND_BLOCK;
+
+	if (block > idx->next)
+		block = idx->next;
+	if (block > idx->first)
+		idx->first = block;
+}
+
+/**
+ * c_find_keys - Trigrams of the needle @s worth testing, at most FIND_KEYS
+ * Returns how many were stored in @keys, 0 if every block may match.
+ */
+int c_find_keys(const uint32_t *s, int n, uint64_t *keys)
+{
+	int nkeys = 0;
+
+	for (int i = 0; i + 3 <= n && nkeys < FIND_KEYS; i++) {
+		uint64_t key = trigram_key(s + i);
+
+		if (key)
+			keys[nkeys++] = key;
+	}
+	return nkeys;
+}
+
+/**
+ * c_find_idx_test - Whether @block may hold a line with every trigram
+ * Blocks the index does not know about always may.
+ */
+int c_find_idx_test(const c_find_idx_t *idx, uint64_t block,
+		    const uint64_t *keys, int nkeys)
+{
+	const uint64_t *bits;
+
+	if (block < idx->first || block >= idx->next)
+		return 1;
+
+	bits = idx_block(idx, block);
+	for (int i = 0; i < nkeys; i++) {
+		int b0, b1;
+
+		key_bits(keys[i], &b0, &b1);
+		if (!(bits[b0 >> 6] & (1ull << (b0 & 63))) ||
+		    !(bits[b1 >> 6] & (1ull << (b1 & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * c_find_scan - First index from @from on where @needle starts in @hay
+ * Candidates for the first code point are found eight at a time, only
+ * those are compared whole. Returns -1 when there is none.
+ */
+int c_find_scan(const uint32_t *hay, int n, const uint32_t *needle, int len,
+		int from)
+{
+	find_v8_t first;
+	int last = n - len;
+	int i = (from > 0) ? from : 0;
+
+	if (len <= 0 || last < 0)
+		return -1;
+
+	first = (find_v8_t) { 0 } + needle[0];
+
+	for (; i <= last; i += 8) {
+		find_v8_t v, eq;
+		uint64_t w[4];
+
+		if (i + 8 > n)
+			break;
+
+		memcpy(&v, hay + i, sizeof(v));
+		eq = (find_v8_t) (v == first);
+		memcpy(w, &eq, sizeof(w));
+		if (!(w[0] | w[1] | w[2] | w[3]))
+			continue;
+
+		for (int k = 0; k < 8 && i + k <= last; k++) {
+			if (eq[k] &&
+			    !memcmp(hay + i + k + 1, needle + 1,
+				    sizeof(uint32_t) * (len - 1)))
+				return i + k;
+		}
+	}
+
+	for (; i <= last; i++) {
+		if (hay[i] == needle[0] &&
+		    !memcmp(hay + i + 1, needle + 1,
+			    sizeof(uint32_t) * (len - 1)))
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef FIND_H
+#define FIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIND_BLOCK	64	/* lines per bloom filter */
+#define FIND_BITS	8192	/* bits per bloom filter */
+#define FIND_KEYS	64	/* trigrams of a needle that are tested */
+
+/**
+ * c_find_idx_t - Trigram bloom filters over a stream of numbered lines
+ * Line n belongs to block n / FIND_BLOCK. A block whose filter lacks a
+ * trigram of the needle cannot hold a match and is skipped whole.
+ * Trigrams are ASCII case folded, mostly blank ones are left out.
+ */
+typedef struct {
+	uint64_t *bits;		/* ring of cap filters */
+	int cap;
+	uint64_t first;		/* oldest block kept */
+	uint64_t next;		/* one past the newest block */
+} c_find_idx_t;
+
+static inline uint32_t c_find_fold(uint32_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+void c_find_idx_free(c_find_idx_t * idx);
+void c_find_idx_reset(c_find_idx_t * idx);
+int c_find_idx_add(c_find_idx_t * idx, uint64_t line, const uint32_t * s,
+		   int n);
+void c_find_idx_trim(c_find_idx_t * idx, uint64_t oldest);
+int c_find_keys(const uint32_t * s, int n, uint64_t * keys);
+int c_find_idx_test(const c_find_idx_t * idx, uint64_t block,
+		    const uint64_t * keys, int nkeys);
+
+int c_find_scan(const uint32_t * hay, int n, const uint32_t * needle, int len,
+		int from);
+
+#endif				/* FIND_H */
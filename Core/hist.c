@@ -0,0 +1,586 @@
+#include "hist.h"
+#include "lz.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HIST_RING_MIN	1024	/* records before the ring first grows */
+#define SPILL_IDX	8192	/* index entries buffered before a flush */
+
+c_hist_stats_t c_hist_stats;
+
+static inline void stat_add(unsigned long *v, long n)
+{
+	__atomic_add_fetch(v, (unsigned long)n, __ATOMIC_RELAXED);
+}
+
+/**
+ * c_hist_init - Keep at most @max_lines records in at most @max_bytes
+ * Either limit may be 0 for none. A byte limit counts slabs the way
+ * they are allocated, compressed slabs as a whole, and keeps at least
+ * HIST_HOT + 1 of them.
+ */
+int c_hist_init(c_hist_t *h, int max_lines, size_t max_bytes)
+{
+	memset(h, 0, sizeof(*h));
+
+	h->max_lines = (max_lines > 0) ? max_lines : 0;
+	if (max_bytes > 0) {
+		h->max_slabs = (int)(max_bytes / HIST_SLAB_SIZE);
+		if (h->max_slabs < HIST_HOT + 1)
+			h->max_slabs = HIST_HOT + 1;
+	}
+
+	h->cap = (h->max_lines > 0 && h->max_lines < HIST_RING_MIN) ?
+	    h->max_lines : HIST_RING_MIN;
+	h->rec = malloc(sizeof(c_hist_rec_t) * h->cap);
+	if (!h->rec)
+		return -1;
+
+	h->head = h->cap - 1;
+	return 0;
+}
+
+/* Decompressed slabs */
+
+static void cache_forget(c_hist_t *h, c_hist_slab_t *s)
+{
+	for (int i = 0; i < HIST_CACHE; i++) {
+		if (h->cache[i].slab == s) {
+			h->cache[i].slab = NULL;
+			stat_add(&c_hist_stats.unpacked, -1);
+		}
+	}
+}
+
+static const char *cache_get(c_hist_t *h, c_hist_slab_t *s)
+{
+	c_hist_cache_t *c = &h->cache[0];
+
+	for (int i = 0; i < HIST_CACHE; i++) {
+		if (h->cache[i].slab == s) {
+			h->cache[i].stamp = ++h->stamp;
+			return h->cache[i].data;
+		}
+		if (!h->cache[i].slab || (c->slab &&
+					  h->cache[i].stamp < c->stamp))
+			c = &h->cache[i];
+	}
+
+	if (!c->data && !(c->data = malloc(HIST_SLAB_SIZE)))
+		return NULL;
+
+	/* the entry is empty until @s is in, unpacked counts full entries */
+	if (c->slab) {
+		c->slab = NULL;
+		stat_add(&c_hist_stats.unpacked, -1);
+	}
+
+	if (c_lz_decompress(s->packed, s->packed_len, c->data,
+			    HIST_SLAB_SIZE) != s->used)
+		return NULL;
+
+	stat_add(&c_hist_stats.unpacked, 1);
+	stat_add(&c_hist_stats.inflates, 1);
+	c->slab = s;
+	c->stamp = ++h->stamp;
+	return c->data;
+}
+
+/* Spill file */
+
+static int spill_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/*
+ * The name is gone again before anything is written, the history only
+ * lives behind the fd and goes with it, on a crash as well.
+ */
+static int spill_open(const char *path, const char *ext)
+{
+	char name[PATH_MAX];
+	int fd;
+
+	snprintf(name, sizeof(name), "%s.%s", path, ext);
+	fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+		  0600);
+	if (fd >= 0 && unlink(name) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* (re)map the first @len bytes of @fd, @old is unmapped in any case */
+static void *spill_map(int fd, void *old, size_t *map_len, size_t len)
+{
+	void *p;
+
+	if (old)
+		munmap(old, *map_len);
+
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		*map_len = 0;
+		return NULL;
+	}
+
+	*map_len = len;
+	return p;
+}
+
+static void spill_unmap(c_hist_spill_t *sp)
+{
+	if (sp->map)
+		munmap(sp->map, sp->map_len);
+	if (sp->imap)
+		munmap(sp->imap, sp->imap_len);
+
+	sp->map = NULL;
+	sp->imap = NULL;
+	sp->map_len = sp->imap_len = 0;
+}
+
+/* empty both files, the disk space goes back right away */
+static void spill_truncate(c_hist_spill_t *sp)
+{
+	spill_unmap(sp);
+	if (sp->fd >= 0 && ftruncate(sp->fd, 0) != 0)
+		c_log_warn("Truncating %s.dat failed: %s", sp->path,
+			   strerror(errno));
+	if (sp->ifd >= 0 && ftruncate(sp->ifd, 0) != 0)
+		c_log_warn("Truncating %s.idx failed: %s", sp->path,
+			   strerror(errno));
+
+	sp->lines = sp->flushed = 0;
+	sp->size = 0;
+	sp->wlen = 0;
+	sp->ilen = 0;
+}
+
+static void spill_close(c_hist_spill_t *sp)
+{
+	if (!sp->path)
+		return;
+
+	spill_truncate(sp);
+	if (sp->fd >= 0)
+		close(sp->fd);
+	if (sp->ifd >= 0)
+		close(sp->ifd);
+
+	free(sp->path);
+	free(sp->wbuf);
+	free(sp->ibuf);
+	memset(sp, 0, sizeof(*sp));
+}
+
+/**
+ * c_hist_spill - Append the records the limits drop to @path.dat/.idx
+ * Both files are unlinked as soon as they are open, closing them in
+ * c_hist_free or on exit frees them.
+ */
+int c_hist_spill(c_hist_t *h, const char *path)
+{
+	c_hist_spill_t *sp = &h->spill;
+
+	spill_close(sp);
+
+	sp->fd = sp->ifd = -1;
+	sp->path = strdup(path);
+	sp->wbuf = malloc(HIST_SLAB_SIZE);
+	sp->ibuf = malloc(sizeof(uint64_t) * SPILL_IDX);
+	if (!sp->path || !sp->wbuf || !sp->ibuf)
+		goto fail;
+
+	sp->fd = spill_open(path, "dat");
+	sp->ifd = spill_open(path, "idx");
+	if (sp->fd < 0 || sp->ifd < 0)
+		goto fail;
+
+	return 0;
+
+ fail:
+	c_log_warn("Scrollback spill to %s failed: %s", path, strerror(errno));
+	if (sp->path) {
+		spill_close(sp);
+	} else {
+		free(sp->wbuf);
+		free(sp->ibuf);
+		memset(sp, 0, sizeof(*sp));
+	}
+	return -1;
+}
+
+static int spill_flush(c_hist_spill_t *sp)
+{
+	if (spill_write(sp->fd, sp->wbuf, sp->wlen) != 0 ||
+	    spill_write(sp->ifd, sp->ibuf, sizeof(uint64_t) * sp->ilen) != 0)
+		return -1;
+
+	sp->size += sp->wlen;
+	sp->flushed += sp->ilen;
+	sp->wlen = 0;
+	sp->ilen = 0;
+	return 0;
+}
+
+static void spill_push(c_hist_spill_t *sp, const void *rec, size_t len)
+{
+	if ((sp->wlen + len > HIST_SLAB_SIZE || sp->ilen == SPILL_IDX) &&
+	    spill_flush(sp) != 0) {
+		/* a full disk ends spilling, lines are dropped again */
+		c_log_warn("Scrollback spill to %s failed: %s", sp->path,
+			   strerror(errno));
+		spill_close(sp);
+		return;
+	}
+
+	memcpy(sp->wbuf + sp->wlen, rec, len);
+	sp->ibuf[sp->ilen++] = sp->size + sp->wlen;
+	sp->wlen += len;
+	sp->lines++;
+}
+
+/* spilled record @n, 0 is the oldest */
+static void *spill_get(c_hist_spill_t *sp, int n)
+{
+	uint64_t off, end;
+
+	if (n >= sp->flushed)
+		return sp->wbuf + (sp->ibuf[n - sp->flushed] - sp->size);
+
+	if (sizeof(uint64_t) * sp->flushed > sp->imap_len) {
+		sp->imap = spill_map(sp->ifd, sp->imap, &sp->imap_len,
+				     sizeof(uint64_t) * sp->flushed);
+		if (!sp->imap)
+			return NULL;
+	}
+
+	off = sp->imap[n];
+	end = (n + 1 < sp->flushed) ? sp->imap[n + 1] : sp->size;
+	if (end > sp->map_len) {
+		sp->map = spill_map(sp->fd, sp->map, &sp->map_len, sp->size);
+		if (!sp->map)
+			return NULL;
+	}
+
+	return sp->map + off;
+}
+
+/* Slabs */
+
+static void slab_unpack(c_hist_slab_t *s)
+{
+	if (!s->packed)
+		return;
+
+	stat_add(&c_hist_stats.raw, -(long)s->used);
+	stat_add(&c_hist_stats.packed, -(long)s->packed_len);
+	free(s->packed);
+	s->packed = NULL;
+	s->packed_len = 0;
+}
+
+/* compress @s and let go of its records, if that saves anything */
+static void slab_pack(c_hist_slab_t *s)
+{
+	size_t bound = LZ_BOUND(s->used);
+	unsigned char *z = malloc(bound);
+	size_t len;
+
+	if (!z)
+		return;
+
+	len = c_lz_compress(s->data, s->used, z, bound);
+	if (len == 0 || len >= s->used) {
+		free(z);
+		return;
+	}
+
+	s->packed = realloc(z, len);
+	if (!s->packed)
+		s->packed = z;
+	s->packed_len = len;
+	free(s->data);
+	s->data = NULL;
+
+	stat_add(&c_hist_stats.raw, (long)s->used);
+	stat_add(&c_hist_stats.packed, (long)len);
+}
+
+static void slab_list_free(c_hist_slab_t *s)
+{
+	while (s) {
+		c_hist_slab_t *next = s->next;
+
+		slab_unpack(s);
+		free(s->data);
+		free(s);
+		s = next;
+	}
+}
+
+void c_hist_free(c_hist_t *h)
+{
+	for (int i = 0; i < HIST_CACHE; i++) {
+		if (h->cache[i].slab)
+			stat_add(&c_hist_stats.unpacked, -1);
+		free(h->cache[i].data);
+	}
+
+	spill_close(&h->spill);
+	slab_list_free(h->oldest);
+	slab_list_free(h->spare);
+	free(h->rec);
+	memset(h, 0, sizeof(*h));
+}
+
+/**
+ * c_hist_reset - Drop every record
+ * The slabs move to the spare list as a whole, compressed ones are
+ * cleaned up when they are taken again. A spill file is emptied.
+ */
+void c_hist_reset(c_hist_t *h)
+{
+	if (h->spill.path)
+		spill_truncate(&h->spill);
+
+	for (int i = 0; i < HIST_CACHE; i++) {
+		if (h->cache[i].slab)
+			stat_add(&c_hist_stats.unpacked, -1);
+		h->cache[i].slab = NULL;
+	}
+
+	if (h->newest) {
+		h->newest->next = h->spare;
+		h->spare = h->oldest;
+	}
+
+	h->oldest = h->newest = h->warm = NULL;
+	h->nwarm = 0;
+	h->count = 0;
+	h->head = h->cap - 1;
+}
+
+/* hand the oldest record to the spill file, it ends where the next begins */
+static void hist_spill(c_hist_t *h)
+{
+	int i = (h->head - h->count + 1 + h->cap) % h->cap;
+	c_hist_rec_t *r = &h->rec[i], *next = &h->rec[(i + 1) % h->cap];
+	size_t end = r->slab->used;
+	const char *data;
+
+	if (h->count > 1 && next->slab == r->slab)
+		end = next->off;
+
+	data = r->slab->data ? r->slab->data : cache_get(h, r->slab);
+	if (data)
+		spill_push(&h->spill, data + r->off, end - r->off);
+}
+
+/* the oldest record always lives in the oldest slab */
+static void hist_drop(c_hist_t *h)
+{
+	c_hist_slab_t *s = h->oldest;
+
+	if (h->spill.path)
+		hist_spill(h);
+
+	h->count--;
+	if (!s || --s->lines > 0)
+		return;
+
+	if (s == h->newest) {
+		s->used = 0;
+		return;
+	}
+
+	if (s == h->warm) {
+		h->warm = s->next;
+		h->nwarm--;
+	}
+
+	cache_forget(h, s);
+	h->oldest = s->next;
+	s->next = h->spare;
+	h->spare = s;
+}
+
+static c_hist_slab_t *slab_take(c_hist_t *h)
+{
+	c_hist_slab_t *s;
+
+	/* out of budget: recycle the oldest slab with the lines in it */
+	if (!h->spare && h->max_slabs > 0 && h->nslabs >= h->max_slabs) {
+		s = h->oldest;
+		while (h->count > 0 && h->oldest == s && s != h->newest)
+			hist_drop(h);
+	}
+
+	s = h->spare;
+	if (s) {
+		h->spare = s->next;
+		slab_unpack(s);
+	} else {
+		s = calloc(1, sizeof(c_hist_slab_t));
+		if (!s)
+			return NULL;
+		h->nslabs++;
+	}
+
+	if (!s->data && !(s->data = malloc(HIST_SLAB_SIZE))) {
+		s->next = h->spare;
+		h->spare = s;
+		return NULL;
+	}
+
+	s->next = NULL;
+	s->used = 0;
+	s->lines = 0;
+	return s;
+}
+
+/* append @s as the newest slab and compress what left the hot window */
+static void slab_append(c_hist_t *h, c_hist_slab_t *s)
+{
+	if (h->newest)
+		h->newest->next = s;
+	else
+		h->oldest = s;
+	h->newest = s;
+
+	if (!h->warm)
+		h->warm = s;
+	h->nwarm++;
+
+	while (h->nwarm > HIST_HOT) {
+		slab_pack(h->warm);
+		h->warm = h->warm->next;
+		h->nwarm--;
+	}
+}
+
+/* make room for one more record, the ring keeps its oldest first */
+static int ring_grow(c_hist_t *h)
+{
+	int cap = h->cap * 2;
+	c_hist_rec_t *rec;
+
+	if (h->count < h->cap)
+		return 0;
+
+	if (h->max_lines > 0 && cap > h->max_lines)
+		cap = h->max_lines;
+	if (cap <= h->cap)
+		return -1;
+
+	rec = malloc(sizeof(c_hist_rec_t) * cap);
+	if (!rec)
+		return -1;
+
+	for (int i = 0; i < h->count; i++)
+		rec[i] = h->rec[(h->head - h->count + 1 + i + h->cap) % h->cap];
+
+	free(h->rec);
+	h->rec = rec;
+	h->cap = cap;
+	h->head = h->count - 1;
+	return 0;
+}
+
+/**
+ * c_hist_push - Room for a new newest record of @len bytes
+ * Drops the oldest records when a limit is reached. Returns NULL when
+ * the record does not fit a slab or memory ran out.
+ */
+void *c_hist_push(c_hist_t *h, size_t len)
+{
+	c_hist_slab_t *s;
+	c_hist_rec_t *r;
+
+	len = (len + 7) & ~(size_t)7;
+	if (!h->rec || len > HIST_SLAB_SIZE)
+		return NULL;
+
+	if (h->max_lines > 0 && h->count >= h->max_lines)
+		hist_drop(h);
+
+	s = h->newest;
+	if (!s || s->used + len > HIST_SLAB_SIZE) {
+		s = slab_take(h);
+		if (!s)
+			return NULL;
+		slab_append(h, s);
+	}
+
+	if (ring_grow(h) != 0)
+		return NULL;
+
+	h->head = (h->head + 1) % h->cap;
+	r = &h->rec[h->head];
+	r->slab = s;
+	r->off = s->used;
+
+	s->used += len;
+	s->lines++;
+	h->count++;
+	return s->data + r->off;
+}
+
+/**
+ * c_hist_lines - Records c_hist_get can reach, spilled ones included
+ */
+int c_hist_lines(c_hist_t *h)
+{
+	return h->count + h->spill.lines;
+}
+
+/**
+ * c_hist_get - Record @age lines back, 0 is the newest
+ * A record of a compressed slab points into the decompression cache,
+ * it stays valid until HIST_CACHE other cold slabs have been read. A
+ * spilled one stays valid until the next call.
+ */
+void *c_hist_get(c_hist_t *h, int age)
+{
+	c_hist_rec_t *r;
+	const char *data;
+
+	if (age < 0)
+		return NULL;
+
+	if (age >= h->count) {
+		age -= h->count;
+		if (age >= h->spill.lines)
+			return NULL;
+		return spill_get(&h->spill, h->spill.lines - 1 - age);
+	}
+
+	r = &h->rec[(h->head - age + h->cap) % h->cap];
+	data = r->slab->data ? r->slab->data : cache_get(h, r->slab);
+
+	return data ? (void *)(data + r->off) : NULL;
+}
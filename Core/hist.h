@@ -0,0 +1,103 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SLAB_SIZE	(256 * 1024)	/* bytes of records per slab */
+#define HIST_HOT	2	/* newest slabs never compressed */
+#define HIST_CACHE	4	/* cold slabs kept decompressed */
+
+typedef struct c_hist_slab {
+	struct c_hist_slab *next;	/* the next newer slab */
+	char *data;		/* records, NULL while only packed */
+	unsigned char *packed;	/* compressed copy of a cold slab */
+	size_t used;
+	size_t packed_len;
+	int lines;		/* records of it still in the ring */
+} c_hist_slab_t;
+
+typedef struct {
+	c_hist_slab_t *slab;
+	size_t off;
+} c_hist_rec_t;
+
+/* a decompressed cold slab */
+typedef struct {
+	c_hist_slab_t *slab;	/* NULL when free */
+	char *data;
+	unsigned long stamp;	/* last use, for LRU */
+} c_hist_cache_t;
+
+/**
+ * c_hist_spill_t - Records the limits dropped, appended to disk
+ * @path.dat holds the records back to back, @path.idx the offset of
+ * each one as a uint64_t, so line n is two loads out of the mappings.
+ * Appends collect in @wbuf/@ibuf, lines from @flushed on live there.
+ */
+typedef struct {
+	char *path;		/* NULL while not spilling */
+	int fd, ifd;
+	int lines;		/* records spilled, buffered ones included */
+	int flushed;		/* records written to both files */
+	uint64_t size;		/* bytes written to @path.dat */
+
+	char *wbuf;
+	size_t wlen;
+	uint64_t *ibuf;
+	int ilen;
+
+	char *map;		/* @path.dat as far as it was read */
+	size_t map_len;
+	uint64_t *imap;		/* @path.idx as far as it was read */
+	size_t imap_len;
+} c_hist_spill_t;
+
+/**
+ * c_hist_t - FIFO of variable sized records carved out of large slabs
+ * Records are bump allocated from the newest slab. Dropping the oldest
+ * record frees nothing, once every record of a slab is gone the slab
+ * is recycled for new ones. Slabs older than the HIST_HOT newest are
+ * compressed and only expanded again when a record of them is read.
+ * With c_hist_spill the records the limits drop go to a file instead,
+ * they keep their age and stay readable through c_hist_get.
+ */
+typedef struct {
+	c_hist_rec_t *rec;	/* ring of records, @head is the newest */
+	int cap;
+	int head;
+	int count;
+	int max_lines;		/* 0 is no limit */
+	int max_slabs;		/* 0 is no limit */
+
+	c_hist_slab_t *oldest, *newest;
+	c_hist_slab_t *warm;	/* oldest slab not compressed yet */
+	int nwarm;		/* slabs from warm to newest */
+	c_hist_slab_t *spare;	/* empty slabs ready for reuse */
+	int nslabs;		/* allocated, spare ones included */
+
+	c_hist_cache_t cache[HIST_CACHE];
+	unsigned long stamp;
+
+	c_hist_spill_t spill;
+} c_hist_t;
+
+/* counters over every c_hist_t */
+typedef struct {
+	unsigned long raw;	/* bytes of records in compressed slabs */
+	unsigned long packed;	/* what they take compressed */
+	unsigned long unpacked;	/* slabs held decompressed right now */
+	unsigned long inflates;	/* decompressions so far */
+} c_hist_stats_t;
+
+extern c_hist_stats_t c_hist_stats;
+
+int c_hist_init(c_hist_t * h, int max_lines, size_t max_bytes);
+int c_hist_spill(c_hist_t * h, const char *path);
+int c_hist_lines(c_hist_t * h);
+void c_hist_free(c_hist_t * h);
+void c_hist_reset(c_hist_t * h);
+void *c_hist_push(c_hist_t * h, size_t len);
+void *c_hist_get(c_hist_t * h, int age);
+
+#endif				/* HIST_H */
@@ -0,0 +1,253 @@
+#include "loop.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define LOOP_MAX_EVENTS	64
+
+static int epfd = -1;
+static c_watch_t *ready_head = NULL;	/* watches with undispatched events */
+static c_watch_t *ready_tail = NULL;
+static c_watch_t *graveyard = NULL;	/* removed while dispatching */
+
+int c_loop_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		c_log_fatal("epoll_create1 failed: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ready_push(c_watch_t *wt)
+{
+	if (wt->queued)
+		return;
+
+	wt->queued = 1;
+	wt->next = NULL;
+	if (ready_tail)
+		ready_tail->next = wt;
+	else
+		ready_head = wt;
+	ready_tail = wt;
+}
+
+/**
+ * c_loop_add - Register @fd once, it stays registered until c_loop_del
+ */
+c_watch_t *c_loop_add(int fd, uint32_t events, watch_fn cb, void *data)
+{
+	struct epoll_event ev;
+	c_watch_t *wt;
+
+	if (epfd < 0 || fd < 0 || !cb)
+		return NULL;
+
+	wt = calloc(1, sizeof(c_watch_t));
+	if (!wt)
+		return NULL;
+
+	wt->fd = fd;
+	wt->events = events;
+	wt->cb = cb;
+	wt->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = wt;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		c_log_error("Failed to watch fd %d: %s", fd, strerror(errno));
+		free(wt);
+		return NULL;
+	}
+
+	return wt;
+}
+
+int c_loop_mod(c_watch_t *wt, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (!wt || wt->dead)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = wt;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, wt->fd, &ev) != 0)
+		return -1;
+
+	wt->events = events;
+	return 0;
+}
+
+/**
+ * c_loop_del - Unregister a watch
+ * Safe to call from inside any callback, the memory is released once the
+ * current dispatch round is over.
+ */
+void c_loop_del(c_watch_t *wt)
+{
+	if (!wt || wt->dead)
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, wt->fd, NULL);
+	if (wt->is_timer)
+		close(wt->fd);
+	wt->dead = 1;
+	wt->cb = NULL;
+
+	/* still referenced by the ready list, let dispatch unlink it */
+	if (wt->queued)
+		return;
+
+	wt->next = graveyard;
+	graveyard = wt;
+}
+
+/**
+ * c_loop_kick - Dispatch @wt on the next run as if its fd became readable
+ */
+void c_loop_kick(c_watch_t *wt)
+{
+	if (!wt || wt->dead)
+		return;
+
+	wt->revents |= EPOLLIN;
+	ready_push(wt);
+}
+
+static void loop_reap(void)
+{
+	while (graveyard) {
+		c_watch_t *wt = graveyard;
+		graveyard = wt->next;
+		free(wt);
+	}
+}
+
+/**
+ * c_loop_run - Wait for events and dispatch them
+ * Returns the number of callbacks that ran. Watches that reported
+ * LOOP_AGAIN keep the loop from sleeping on the next run.
+ */
+int c_loop_run(int timeout)
+{
+	struct epoll_event evs[LOOP_MAX_EVENTS];
+	c_watch_t *list;
+	int n, dispatched = 0;
+
+	if (ready_head)
+		timeout = 0;
+
+	n = epoll_wait(epfd, evs, LOOP_MAX_EVENTS, timeout);
+	if (n < 0 && errno != EINTR)
+		c_log_error("epoll_wait failed: %s", strerror(errno));
+
+	for (int i = 0; i < n; i++) {
+		c_watch_t *wt = evs[i].data.ptr;
+
+		if (wt->dead)
+			continue;
+		wt->revents |= evs[i].events;
+		ready_push(wt);
+	}
+
+	/* detach, callbacks that return LOOP_AGAIN queue up for the next run */
+	list = ready_head;
+	ready_head = ready_tail = NULL;
+
+	while (list) {
+		c_watch_t *wt = list;
+		uint32_t events = wt->revents;
+
+		list = wt->next;
+		wt->queued = 0;
+		wt->revents = 0;
+
+		if (wt->dead) {
+			wt->next = graveyard;
+			graveyard = wt;
+			continue;
+		}
+
+		/* acknowledge the expirations, a stale edge has none */
+		if (wt->is_timer) {
+			uint64_t expirations;
+
+			if (read(wt->fd, &expirations, sizeof(expirations)) !=
+			    sizeof(expirations))
+				continue;
+		}
+
+		dispatched++;
+		if (wt->cb(wt, events) == LOOP_AGAIN && !wt->dead) {
+			wt->revents |= events;
+			ready_push(wt);
+		}
+	}
+
+	loop_reap();
+	return dispatched;
+}
+
+/**
+ * c_loop_timer - Call @cb every @period_ms milliseconds
+ * Backed by a timerfd, so the loop does not need a poll timeout to keep
+ * time. Remove it with c_loop_del like any other watch.
+ */
+c_watch_t *c_loop_timer(int period_ms, watch_fn cb, void *data)
+{
+	struct itimerspec its;
+	c_watch_t *wt;
+	int fd;
+
+	if (period_ms <= 0)
+		return NULL;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		c_log_error("timerfd_create failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = period_ms / 1000;
+	its.it_interval.tv_nsec = (long)(period_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+
+	if (timerfd_settime(fd, 0, &its, NULL) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	wt = c_loop_add(fd, EPOLLIN | EPOLLET, cb, data);
+	if (!wt) {
+		close(fd);
+		return NULL;
+	}
+
+	wt->is_timer = 1;
+	return wt;
+}
+
+/**
+ * c_loop_now - Monotonic clock in microseconds
+ */
+uint64_t c_loop_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
@@ -0,0 +1,43 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* Return values for watch callbacks */
+#define LOOP_DONE	0	/* fd was drained, wait for the next edge */
+#define LOOP_AGAIN	1	/* fd still has data, dispatch again next run */
+
+struct c_watch;
+
+typedef int (*watch_fn)(struct c_watch * wt, uint32_t events);
+
+/**
+ * c_watch_t - A persistent fd registration in the event loop
+ * The watch itself is handed to epoll as user data, so a wakeup
+ * dispatches straight to @cb without searching for the owner.
+ */
+typedef struct c_watch {
+	int fd;
+	uint32_t events;
+	watch_fn cb;
+	void *data;		/* owner, e.g. cosh_win_t */
+
+	int is_timer;		/* fd is a timerfd owned by the loop */
+
+	uint32_t revents;	/* events not yet dispatched */
+	int queued;		/* on the ready list */
+	int dead;		/* removed, freed after dispatch */
+	struct c_watch *next;
+} c_watch_t;
+
+int c_loop_init(void);
+c_watch_t *c_loop_add(int fd, uint32_t events, watch_fn cb, void *data);
+int c_loop_mod(c_watch_t * wt, uint32_t events);
+void c_loop_del(c_watch_t * wt);
+void c_loop_kick(c_watch_t * wt);
+int c_loop_run(int timeout);
+c_watch_t *c_loop_timer(int period_ms, watch_fn cb, void *data);
+uint64_t c_loop_now(void);
+
+#endif				/* LOOP_H */
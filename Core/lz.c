@@ -0,0 +1,180 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Byte oriented LZ77 in the style of LZ4. A sequence is a token byte
+ * holding the literal count and the match length - 4 in its nibbles,
+ * longer counts continue in bytes of 255, then the literals and a two
+ * byte little endian match offset. The last sequence has no match.
+ */
+
+#define LZ_HASH_BITS	13
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* count continuation, returns NULL when @op would pass @oend */
+static uint8_t *put_len(uint8_t *op, uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			size_t nlit, size_t off, size_t mlen)
+{
+	size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)(((nlit < 15) ? nlit : 15) << 4 | ((ml < 15) ? ml : 15));
+
+	if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15)))
+		return NULL;
+	if ((size_t)(oend - op) < nlit)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (!mlen)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = (uint8_t)(off & 0xff);
+	*op++ = (uint8_t)(off >> 8);
+
+	if (ml >= 15 && !(op = put_len(op, oend, ml - 15)))
+		return NULL;
+	return op;
+}
+
+/**
+ * c_lz_compress - Compress @n bytes of @src into @dst
+ * Returns the compressed size, 0 when it does not fit @cap bytes.
+ */
+size_t c_lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *base = src, *ip = src, *anchor = src;
+	const uint8_t *end = base + n;
+	uint8_t *op = dst, *oend = op + cap;
+
+	memset(table, 0, sizeof(table));
+
+	while (n >= LZ_MIN_MATCH && ip + LZ_MIN_MATCH <= end) {
+		uint32_t h = lz_hash(read32(ip));
+		uint32_t pos = table[h];	/* 0 is empty, else offset + 1 */
+		const uint8_t *ref = base + pos - (pos > 0);
+		size_t len;
+
+		table[h] = (uint32_t)(ip - base) + 1;
+
+		if (!pos || ip - ref > LZ_MAX_OFFSET ||
+		    read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		for (len = LZ_MIN_MATCH; ip + len < end && ref[len] == ip[len];
+		     len++) ;
+
+		op = put_seq(op, oend, anchor, (size_t)(ip - anchor),
+			     (size_t)(ip - ref), len);
+		if (!op)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+	return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+/* count continuation, returns NULL on truncated input */
+static const uint8_t *get_len(const uint8_t *ip, const uint8_t *iend,
+			      size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+
+	return ip;
+}
+
+/**
+ * c_lz_decompress - Expand @n bytes of @src into @dst
+ * Returns the expanded size, 0 when the input is corrupt or @cap is short.
+ */
+size_t c_lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *op = dst, *oend = op + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t nlit = token >> 4;
+		size_t mlen = token & 15;
+		size_t off;
+		const uint8_t *ref;
+
+		if (nlit == 15 && !(ip = get_len(ip, iend, &nlit)))
+			return 0;
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+			return 0;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		/* the last sequence ends with its literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return 0;
+		off = (size_t)ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+
+		if (mlen == 15 && !(ip = get_len(ip, iend, &mlen)))
+			return 0;
+		mlen += LZ_MIN_MATCH;
+
+		if (off == 0 || off > (size_t)(op - (uint8_t *)dst) ||
+		    (size_t)(oend - op) < mlen)
+			return 0;
+
+		/* byte by byte, a match may overlap what it produces */
+		ref = op - off;
+		while (mlen--)
+			*op++ = *ref++;
+	}
+
+	return (size_t)(op - (uint8_t *)dst);
+}
@@ -0,0 +1,12 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/* worst case output of c_lz_compress for @n input bytes */
+#define LZ_BOUND(n)	((n) + (n) / 255 + 16)
+
+size_t c_lz_compress(const void *src, size_t n, void *dst, size_t cap);
+size_t c_lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif				/* LZ_H */
@@ -0,0 +1,217 @@
+#include "proc.h"
+#include "loop.h"
+#include "log.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+/* Child lifecycle, a terminated child stays here until it is reaped */
+typedef enum {
+	CHILD_RUNNING = 0,
+	CHILD_HANGUP,		/* SIGHUP sent, waiting for the grace period */
+	CHILD_KILLED,		/* SIGKILL sent, waiting for SIGCHLD */
+} child_state_t;
+
+typedef struct child {
+	pid_t pid;
+	child_state_t state;
+	child_fn cb;		/* exit notification, NULL once orphaned */
+	void *data;
+	c_watch_t *timer;
+	struct child *next;
+} child_t;
+
+static child_t *children = NULL;
+static sigset_t blocked;
+static void (*resize_cb)(void) = NULL;
+
+static child_t *child_find(pid_t pid)
+{
+	for (child_t *c = children; c; c = c->next)
+		if (c->pid == pid)
+			return c;
+	return NULL;
+}
+
+static void child_remove(child_t *dead)
+{
+	for (child_t **pp = &children; *pp; pp = &(*pp)->next) {
+		if (*pp == dead) {
+			*pp = dead->next;
+			break;
+		}
+	}
+
+	c_loop_del(dead->timer);
+	free(dead);
+}
+
+/**
+ * proc_reap - Collect every exited child without blocking
+ */
+static void proc_reap(void)
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		child_t *c = child_find(pid);
+		child_fn cb;
+		void *data;
+
+		if (!c)
+			continue;
+
+		cb = c->cb;
+		data = c->data;
+		child_remove(c);
+
+		if (cb)
+			cb(pid, status, data);
+	}
+}
+
+static int proc_on_signal(c_watch_t *wt, uint32_t events)
+{
+	struct signalfd_siginfo si;
+	int winch = 0, chld = 0;
+	(void)events;
+
+	while (read(wt->fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGWINCH)
+			winch = 1;
+		else if (si.ssi_signo == SIGCHLD)
+			chld = 1;
+	}
+
+	/* several SIGCHLD may merge into one, proc_reap loops */
+	if (chld)
+		proc_reap();
+
+	if (winch && resize_cb)
+		resize_cb();
+
+	return LOOP_DONE;
+}
+
+/**
+ * c_proc_init - Route SIGWINCH and SIGCHLD through a signalfd
+ * Must run before any child is forked and after c_loop_init.
+ */
+int c_proc_init(void)
+{
+	int fd;
+
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGWINCH);
+	sigaddset(&blocked, SIGCHLD);
+
+	if (sigprocmask(SIG_BLOCK, &blocked, NULL) != 0) {
+		c_log_fatal("Cannot block signals: %s", strerror(errno));
+		return -1;
+	}
+
+	fd = signalfd(-1, &blocked, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		c_log_fatal("signalfd failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (!c_loop_add(fd, EPOLLIN | EPOLLET, proc_on_signal, NULL)) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void c_proc_on_resize(void (*fn)(void))
+{
+	resize_cb = fn;
+}
+
+/**
+ * c_proc_child_setup - Undo our signal mask in a freshly forked child
+ * The mask survives exec, a shell with SIGCHLD blocked never reaps.
+ */
+void c_proc_child_setup(void)
+{
+	sigprocmask(SIG_UNBLOCK, &blocked, NULL);
+}
+
+/**
+ * c_proc_watch - Call @cb once @pid exits and has been reaped
+ */
+int c_proc_watch(pid_t pid, child_fn cb, void *data)
+{
+	child_t *c = calloc(1, sizeof(child_t));
+
+	if (!c)
+		return -1;
+
+	c->pid = pid;
+	c->state = CHILD_RUNNING;
+	c->cb = cb;
+	c->data = data;
+	c->next = children;
+	children = c;
+
+	return 0;
+}
+
+static int proc_on_grace(c_watch_t *wt, uint32_t events)
+{
+	child_t *c = (child_t *) wt->data;
+	(void)events;
+
+	if (c->state == CHILD_HANGUP) {
+		kill(c->pid, SIGKILL);
+		c->state = CHILD_KILLED;
+	}
+
+	c_loop_del(c->timer);
+	c->timer = NULL;
+
+	return LOOP_DONE;
+}
+
+/**
+ * c_proc_terminate - Hang up @pid, escalate to SIGKILL after @grace_ms
+ * Returns immediately. The exit callback is dropped because the owner is
+ * going away, the child is reaped by the SIGCHLD handler.
+ */
+void c_proc_terminate(pid_t pid, int grace_ms)
+{
+	child_t *c = child_find(pid);
+
+	if (pid <= 0)
+		return;
+
+	if (!c) {
+		if (c_proc_watch(pid, NULL, NULL) != 0) {
+			kill(pid, SIGKILL);
+			return;
+		}
+		c = children;
+	}
+
+	c->cb = NULL;
+	c->data = NULL;
+
+	if (c->state != CHILD_RUNNING)
+		return;
+
+	kill(pid, SIGHUP);
+	c->state = CHILD_HANGUP;
+	c->timer = c_loop_timer(grace_ms, proc_on_grace, c);
+
+	if (!c->timer) {
+		kill(pid, SIGKILL);
+		c->state = CHILD_KILLED;
+	}
+}
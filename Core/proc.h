@@ -0,0 +1,14 @@
+#ifndef PROC_H
+#define PROC_H
+
+#include <sys/types.h>
+
+typedef void (*child_fn)(pid_t pid, int status, void *data);
+
+int c_proc_init(void);
+void c_proc_on_resize(void (*fn)(void));
+void c_proc_child_setup(void);
+int c_proc_watch(pid_t pid, child_fn cb, void *data);
+void c_proc_terminate(pid_t pid, int grace_ms);
+
+#endif				/* PROC_H */
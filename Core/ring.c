@@ -0,0 +1,71 @@
+#include "ring.h"
+
+#include <stdlib.h>
+
+int c_ring_init(c_ring_t *r, size_t size)
+{
+	/* round up to a power of two so wrapping is a mask */
+	size_t cap = RING_CACHELINE;
+	while (cap < size)
+		cap <<= 1;
+
+	r->buf = malloc(cap);
+	if (!r->buf)
+		return -1;
+
+	r->mask = cap - 1;
+	r->head = 0;
+	r->tail = 0;
+	return 0;
+}
+
+void c_ring_free(c_ring_t *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+size_t c_ring_used(c_ring_t *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+	    __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * c_ring_write_ptr - Contiguous free space for the producer
+ * Lets the producer read() straight into the ring.
+ */
+void *c_ring_write_ptr(c_ring_t *r, size_t *room)
+{
+	size_t head = r->head;
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	size_t free_bytes = (r->mask + 1) - (head - tail);
+	size_t to_end = (r->mask + 1) - (head & r->mask);
+
+	*room = (free_bytes < to_end) ? free_bytes : to_end;
+	return r->buf + (head & r->mask);
+}
+
+void c_ring_commit(c_ring_t *r, size_t n)
+{
+	__atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+
+/**
+ * c_ring_read_ptr - Contiguous readable bytes for the consumer
+ */
+const void *c_ring_read_ptr(c_ring_t *r, size_t *avail)
+{
+	size_t tail = r->tail;
+	size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	size_t used = head - tail;
+	size_t to_end = (r->mask + 1) - (tail & r->mask);
+
+	*avail = (used < to_end) ? used : to_end;
+	return r->buf + (tail & r->mask);
+}
+
+void c_ring_consume(c_ring_t *r, size_t n)
+{
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,33 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+#define RING_CACHELINE	64
+
+/**
+ * c_ring_t - Lock-free single producer / single consumer byte ring
+ * @head only moves in the producer, @tail only in the consumer. Both count
+ * bytes ever written/read and wrap through the power of two mask.
+ */
+typedef struct {
+	unsigned char *buf;
+	size_t mask;
+
+	size_t head __attribute__((aligned(RING_CACHELINE)));
+	size_t tail __attribute__((aligned(RING_CACHELINE)));
+} c_ring_t;
+
+int c_ring_init(c_ring_t * r, size_t size);
+void c_ring_free(c_ring_t * r);
+size_t c_ring_used(c_ring_t * r);
+
+/* producer side */
+void *c_ring_write_ptr(c_ring_t * r, size_t *room);
+void c_ring_commit(c_ring_t * r, size_t n);
+
+/* consumer side */
+const void *c_ring_read_ptr(c_ring_t * r, size_t *avail);
+void c_ring_consume(c_ring_t * r, size_t n);
+
+#endif				/* RING_H */
@@ -8,5 +8,9 @@
 #define CONFIGFILENAME "config.ini"
 
 #define WIN_MAX		32	/* Maximal open window */
+#define WIN_WATCH_MAX	8	/* Maximal extra fds watched per window */
+#define WIN_ANIM_MAX	16	/* Maximal running animations */
+#define WIN_ANIM_KEYS	8	/* Maximal keyframes per animation */
+#define WIN_PAIRS_MAX	4096	/* Maximal colour pairs shared by app content */
 
 #endif				/* CONFIGURATION_H */
@@ -33,6 +33,17 @@ static void dispatch_input(int ch)
 	cosh_win_t *f = (wm.focus_idx >= 0) ? wm.stack[wm.focus_idx] : NULL;
 	cfg_keys_t keyconfig = wm.configs.keys;
 
+	/* no window management while a modal is open */
+	if (wm.modal) {
+		if (ch == KEY_MOUSE) {
+			win_handle_mouse();
+		} else if (wm.modal->input_cb) {
+			win_input(wm.modal, ch, NULL);
+		}
+		win_needs_redraw = 1;
+		return;
+	}
+
 	if (ch == wm.configs.keys.modifier) {
 		int next = getch();
 
@@ -64,6 +75,16 @@ static void dispatch_input(int ch)
 			return;
 		}
 
+		if (next == keyconfig.find[0]) {
+			if (f && f->input_cb) {
+				win_input(f, WIN_KEY_FIND, NULL);
+				win_needs_redraw = 1;
+			} else {
+				beep();
+			}
+			return;
+		}
+
 		switch (next) {
 			/* Window Management */
 
@@ -104,6 +125,9 @@ static void dispatch_input(int ch)
 		case CTRL('b'):
 			wm.configs.show_border = !wm.configs.show_border;
 			break;
+		case CTRL('s'):
+			win_toggle_stats();
+			return;
 		}
 	}
 
@@ -113,8 +137,7 @@ static void dispatch_input(int ch)
 			break;
 		default:
 			if (f && f->input_cb) {
-				f->input_cb(f, ch, NULL);
-				f->dirty = 1;
+				win_input(f, ch, NULL);
 			} else if (!f) {
 				win_vibrate();
 			}
@@ -139,69 +162,47 @@ int boot(void)
 	return 0;
 }
 
-int main(void)
+/**
+ * on_stdin - Drain keyboard and mouse input
+ */
+static int on_stdin(c_watch_t *wt, uint32_t events)
 {
-	struct pollfd pfds[WIN_MAX + 1];
 	int ch;
+	(void)wt;
+	(void)events;
+
+	while ((ch = getch()) != ERR) {
+		if (ch == CTRL('/')) {
+			confirm_shutdown();
+		} else {
+			dispatch_input(ch);
+		}
+	}
 
+	return LOOP_DONE;
+}
+
+int main(void)
+{
 	if (boot() != 0) {
 		c_log_fatal("some of booting process was failed. Aborting.");
 		return 1;
 	}
 
+	if (!c_loop_add(STDIN_FILENO, EPOLLIN | EPOLLET, on_stdin, NULL)) {
+		c_log_fatal("Cannot watch the keyboard. Aborting.");
+		return 1;
+	}
+
 	win_spawn_iterm();
 	win_toggle_fullscreen(wm.stack[wm.focus_idx]);
 	win_spawn_help();
 
 	while (1) {
-		if (terminal_resized)
-			win_handle_resize();
-
-		pfds[0].fd = STDIN_FILENO;
-		pfds[0].events = POLLIN;
-		int nfds = 1;
-
-		for (int i = 0; i < wm.count; i++) {
-			if (wm.stack[i]->poll_fd >= 0) {
-				pfds[nfds].fd = wm.stack[i]->poll_fd;
-				pfds[nfds].events = POLLIN;
-				nfds++;
-			}
-		}
-
-		//check for ms
-		int ret = poll(pfds, nfds, wm.configs.desktop.refresh_rate);
-
-		if (ret > 0) {
-			//Keyboard (pfds[0])
-			if (pfds[0].revents & POLLIN) {
-				while ((ch = getch()) != ERR) {
-					if (ch == CTRL('/')) {
-						confirm_shutdown();
-					} else {
-						dispatch_input(ch);
-					}
-				}
-			}
-			// app FD (pfds[1...nfds])
-			int current_pfd = 1;
-			for (int i = 0; i < wm.count; i++) {
-				if (wm.stack[i]->poll_fd >= 0) {
-					if (pfds[current_pfd].revents &
-					    (POLLIN | POLLHUP | POLLERR)) {
-						if (wm.stack[i]->tick_cb)
-							wm.stack[i]->
-							    tick_cb(wm.stack
-								    [i]);
-					}
-					current_pfd++;
-				}
-			}
-
-			win_needs_redraw = 1;
-		}
-
-		if (win_needs_redraw) win_refresh_all();
+		/* tickless: sleep until input, a timer, or the next frame */
+		c_loop_run(win_frame_timeout(-1));
+		win_sched_run();
+		win_frame();
 	}
 
 	return 0;
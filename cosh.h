@@ -6,7 +6,6 @@
 
 #include <string.h>
 #include <errno.h>
-#include <poll.h>
 #include "configuration.h"
 
 typedef struct app_entry {
@@ -0,0 +1,343 @@
+#include "wmcurses.h"
+
+#define PAIR_FIRST	(CP_WIN_START + WIN_MAX)	/* below are the WM's own */
+#define PAIR_EPOCH_FRAMES	60	/* frames between forced repaints */
+
+/**
+ * pair_slot_t - One dynamic colour pair, PAIR_FIRST + its index
+ * Slots sit on a hash chain for exact (fg, bg) lookup and on a LRU list
+ * so the oldest one is reassigned once every pair is in use.
+ */
+typedef struct {
+	int fg, bg;
+	int prev, next;		/* LRU, most recently used at the head */
+	int hnext;		/* hash chain */
+	unsigned long epoch;	/* pair_epoch it was last used in */
+} pair_slot_t;
+
+win_pair_stats_t win_pair_stats;
+
+static pair_slot_t *slots = NULL;
+static int *buckets = NULL;
+static unsigned int bucket_mask = 0;
+static int nslots = 0;
+static int nused = 0;
+static int lru_head = -1;
+static int lru_tail = -1;
+
+/*
+ * An epoch starts with a frame that repaints every window, so a slot
+ * not used since cannot be on screen and is free to redefine. Slots of
+ * the current epoch are never redefined, a repaint is asked for instead.
+ */
+static unsigned long pair_epoch = 1;
+static unsigned long epoch_frame = 0;	/* win_frame_seq it started at */
+static int epoch_pending = 0;
+
+static int pair_setup(void)
+{
+	unsigned int nbuckets = 1;
+
+	nslots = COLOR_PAIRS - PAIR_FIRST;
+	if (nslots > WIN_PAIRS_MAX)
+		nslots = WIN_PAIRS_MAX;
+	if (nslots <= 0)
+		return -1;
+
+	while (nbuckets < (unsigned int)nslots * 2)
+		nbuckets <<= 1;
+
+	slots = calloc(nslots, sizeof(pair_slot_t));
+	buckets = malloc(sizeof(int) * nbuckets);
+	if (!slots || !buckets) {
+		free(slots);
+		free(buckets);
+		slots = NULL;
+		buckets = NULL;
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < nbuckets; i++)
+		buckets[i] = -1;
+	bucket_mask = nbuckets - 1;
+	return 0;
+}
+
+/* colours are palette indices or, on direct colour hosts, 0xRRGGBB */
+static inline unsigned int pair_hash(int fg, int bg)
+{
+	unsigned int key = (unsigned int)(fg + 1) * 2654435761u;
+
+	key ^= (unsigned int)(bg + 1) * 40503u;
+	return (key ^ (key >> 15)) & bucket_mask;
+}
+
+static void lru_unlink(int i)
+{
+	pair_slot_t *s = &slots[i];
+
+	if (s->prev >= 0)
+		slots[s->prev].next = s->next;
+	else
+		lru_head = s->next;
+
+	if (s->next >= 0)
+		slots[s->next].prev = s->prev;
+	else
+		lru_tail = s->prev;
+}
+
+static void lru_push(int i)
+{
+	slots[i].prev = -1;
+	slots[i].next = lru_head;
+	if (lru_head >= 0)
+		slots[lru_head].prev = i;
+	lru_head = i;
+	if (lru_tail < 0)
+		lru_tail = i;
+}
+
+static void hash_unlink(int i)
+{
+	int *pp = &buckets[pair_hash(slots[i].fg, slots[i].bg)];
+
+	while (*pp >= 0 && *pp != i)
+		pp = &slots[*pp].hnext;
+	if (*pp == i)
+		*pp = slots[i].hnext;
+}
+
+static int palette_rgb(int idx);
+
+/* 0xRRGGBB of a colour number, -1 for the terminal default */
+static int color_rgb(int v)
+{
+	if (v < 0)
+		return -1;
+	if (WIN_COLOR_DIRECT)
+		return (v < 8) ? palette_rgb(v) : v;
+	return palette_rgb(v & 0xff);
+}
+
+static int color_dist(int a, int b)
+{
+	int ra = color_rgb(a), rb = color_rgb(b);
+	int d = 0;
+
+	if (ra < 0 || rb < 0)
+		return (ra == rb) ? 0 : 3 * 255 * 255 + 1;
+
+	for (int s = 0; s < 24; s += 8) {
+		int c = ((ra >> s) & 0xff) - ((rb >> s) & 0xff);
+		d += c * c;
+	}
+	return d;
+}
+
+/* the defined pair closest to (@fg, @bg) */
+static int pair_nearest(int fg, int bg)
+{
+	int best = 0, best_d = -1;
+
+	for (int i = 0; i < nused; i++) {
+		int d = color_dist(slots[i].fg, fg) + color_dist(slots[i].bg, bg);
+
+		if (best_d < 0 || d < best_d) {
+			best = i;
+			best_d = d;
+		}
+	}
+	return best;
+}
+
+/* repaint everything so the next frame opens a new epoch */
+static void epoch_request(void)
+{
+	/* more pairs on screen than there are, do not repaint every frame */
+	if (epoch_pending || win_frame_seq - epoch_frame < PAIR_EPOCH_FRAMES)
+		return;
+
+	epoch_pending = 1;
+	for (int i = 0; i < wm.count; i++)
+		wm.stack[i]->dirty = 1;
+	win_comp_invalidate();
+	win_needs_redraw = 1;
+}
+
+/**
+ * win_pair_frame - Called before a frame is rendered
+ */
+void win_pair_frame(void)
+{
+	if (!epoch_pending)
+		return;
+
+	epoch_pending = 0;
+	epoch_frame = win_frame_seq;
+	pair_epoch++;
+}
+
+/**
+ * win_pair - Colour pair showing @fg on @bg, -1 is the terminal default
+ * Pairs are shared by every window. When all of them are taken the least
+ * recently used one is redefined, as long as it is not on screen. If it
+ * may be, the nearest pair stands in until the next epoch.
+ * Returns 0 if there is no pair to spare.
+ */
+int win_pair(int fg, int bg)
+{
+	unsigned int h;
+	int i;
+
+	if (!slots && pair_setup() != 0)
+		return 0;
+
+	h = pair_hash(fg, bg);
+	for (i = buckets[h]; i >= 0; i = slots[i].hnext) {
+		if (slots[i].fg == fg && slots[i].bg == bg) {
+			win_pair_stats.hits++;
+			slots[i].epoch = pair_epoch;
+			if (lru_head != i) {
+				lru_unlink(i);
+				lru_push(i);
+			}
+			return PAIR_FIRST + i;
+		}
+	}
+
+	win_pair_stats.misses++;
+	if (nused < nslots) {
+		i = nused++;
+	} else if (slots[lru_tail].epoch == pair_epoch) {
+		win_pair_stats.fallbacks++;
+		epoch_request();
+		return PAIR_FIRST + pair_nearest(fg, bg);
+	} else {
+		i = lru_tail;
+		lru_unlink(i);
+		hash_unlink(i);
+		win_pair_stats.evictions++;
+	}
+
+	slots[i].fg = fg;
+	slots[i].bg = bg;
+	slots[i].epoch = pair_epoch;
+	slots[i].hnext = buckets[h];
+	buckets[h] = i;
+	lru_push(i);
+
+#ifdef NCURSES_EXT_COLORS
+	init_extended_pair(PAIR_FIRST + i, fg, bg);
+#else
+	init_pair(PAIR_FIRST + i, fg, bg);
+#endif
+	return PAIR_FIRST + i;
+}
+
+/* Colour mapping */
+
+/* xterm's system colours, 16..255 follow from the formulas below */
+static const unsigned char sys_rgb[16][3] = {
+	{0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+	{0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+	{127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+	{92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255},
+};
+
+static const unsigned char cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+/* RGB555 -> nearest xterm-256 index, built on first use */
+static unsigned char rgb555[1 << 15];
+static int rgb555_ready = 0;
+
+static int palette_rgb(int idx)
+{
+	int r, g, b;
+
+	if (idx < 16) {
+		r = sys_rgb[idx][0];
+		g = sys_rgb[idx][1];
+		b = sys_rgb[idx][2];
+	} else if (idx < 232) {
+		idx -= 16;
+		r = cube_levels[idx / 36];
+		g = cube_levels[(idx / 6) % 6];
+		b = cube_levels[idx % 6];
+	} else {
+		r = g = b = 8 + (idx - 232) * 10;
+	}
+
+	return (r << 16) | (g << 8) | b;
+}
+
+static int cube_nearest(int v)
+{
+	int best = 0;
+
+	for (int i = 1; i < 6; i++)
+		if (abs(cube_levels[i] - v) < abs(cube_levels[best] - v))
+			best = i;
+	return best;
+}
+
+static inline int rgb_dist(int a, int b)
+{
+	int dr = ((a >> 16) & 0xff) - ((b >> 16) & 0xff);
+	int dg = ((a >> 8) & 0xff) - ((b >> 8) & 0xff);
+	int db = (a & 0xff) - (b & 0xff);
+
+	return dr * dr + dg * dg + db * db;
+}
+
+/*
+ * The 16 system colours are left out, terminals theme them and they are
+ * rarely what an RGB value meant. Each entry picks the closer of the
+ * nearest cube colour and the nearest grey.
+ */
+static void rgb555_build(void)
+{
+	for (int i = 0; i < (1 << 15); i++) {
+		int r = ((i >> 10) & 31) << 3 | 4;
+		int g = ((i >> 5) & 31) << 3 | 4;
+		int b = (i & 31) << 3 | 4;
+		int rgb = (r << 16) | (g << 8) | b;
+		int cube = 16 + cube_nearest(r) * 36 + cube_nearest(g) * 6 +
+		    cube_nearest(b);
+		int grey = 232 + ((r + g + b) / 3 - 3) / 10;
+
+		if (grey < 232)
+			grey = 232;
+		if (grey > 255)
+			grey = 255;
+
+		rgb555[i] = (rgb_dist(rgb, palette_rgb(grey)) <
+			     rgb_dist(rgb, palette_rgb(cube))) ? grey : cube;
+	}
+	rgb555_ready = 1;
+}
+
+/**
+ * win_color_rgb - Colour number for an RGB value
+ * Passed through on direct colour hosts, otherwise one table load.
+ */
+int win_color_rgb(int r, int g, int b)
+{
+	if (WIN_COLOR_DIRECT)
+		return (r << 16) | (g << 8) | b;
+
+	if (!rgb555_ready)
+		rgb555_build();
+	return rgb555[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+}
+
+/**
+ * win_color_index - Colour number for an xterm-256 palette index
+ * Direct colour hosts only keep the first 8 as palette colours.
+ */
+int win_color_index(int idx)
+{
+	if (WIN_COLOR_DIRECT && idx >= 8)
+		return palette_rgb(idx);
+	return idx;
+}
@@ -0,0 +1,35 @@
+#ifndef WMCOLOR_H
+#define WMCOLOR_H
+
+#define WIN_COLOR_DIRECT	(COLORS >= 0x1000000)	/* colour numbers are RGB */
+
+/* counters of the shared colour pair cache */
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;	/* least recently used pair reassigned */
+	unsigned long fallbacks;	/* every pair on screen, nearest one used */
+} win_pair_stats_t;
+
+extern win_pair_stats_t win_pair_stats;
+
+int win_pair(int fg, int bg);
+void win_pair_frame(void);
+int win_color_rgb(int r, int g, int b);
+int win_color_index(int idx);
+
+/**
+ * win_setcchar - setcchar() for any pair win_pair() returns
+ * ncurses takes pairs past SHRT_MAX through @opts.
+ */
+static inline int win_setcchar(cchar_t *cc, const wchar_t *wstr, attr_t a,
+			       int pair)
+{
+#ifdef NCURSES_EXT_COLORS
+	return setcchar(cc, wstr, a, 0, &pair);
+#else
+	return setcchar(cc, wstr, a, (short)pair, NULL);
+#endif
+}
+
+#endif				/* WMCOLOR_H */
@@ -0,0 +1,652 @@
+#define _XOPEN_SOURCE 700	/* wcwidth */
+
+#include "wmcurses.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <wchar.h>
+
+/*
+ * Grid compositor
+ *
+ * Instead of update_panels and doupdate, the windows are copied bottom
+ * to top into a back grid, every row of it is compared against the front
+ * grid holding what the terminal shows, and only the cells that differ
+ * are written, with the cursor moves and SGR sequences they need, into
+ * one buffer that goes out with a single write. Only the first code
+ * point of a cell is kept, combining characters are dropped.
+ *
+ * Where the terminal supports it a frame is framed as a synchronized
+ * update (DEC mode 2026), so it shows all at once however the bytes
+ * arrive.
+ */
+
+#define COMP_CONT	0xffffffffu	/* right half of a wide character */
+#define COMP_NONE	0xfffffffeu	/* never drawn, forces a repaint */
+#define COMP_GAP	4	/* unchanged cells rewritten instead of a jump */
+
+#define SYNC_BEGIN	"\033[?2026h"
+#define SYNC_END	"\033[?2026l"
+
+#define COMP_A_BOLD	0x01
+#define COMP_A_DIM	0x02
+#define COMP_A_ITALIC	0x04
+#define COMP_A_UNDERLINE	0x08
+#define COMP_A_BLINK	0x10
+#define COMP_A_REVERSE	0x20
+#define COMP_A_INVIS	0x40
+
+/**
+ * comp_cell_t - One screen cell, 8 bytes so it compares as one word
+ */
+typedef union {
+	struct {
+		uint32_t ch;
+		uint16_t pair;
+		uint16_t attr;	/* COMP_A_* */
+	} c;
+	uint64_t word;
+} comp_cell_t;
+
+win_comp_stats_t win_comp_stats;
+
+static comp_cell_t *front = NULL;	/* what the terminal shows */
+static comp_cell_t *back = NULL;	/* the frame being composited */
+static cchar_t *rowbuf = NULL;
+static int grid_h = 0, grid_w = 0;
+static int need_clear = 1;
+
+static char *out = NULL;
+static size_t out_len = 0, out_cap = 0;
+static int out_failed = 0;
+static int sync_update = 0;
+
+/* terminal state after the last byte in out, -1 is unknown */
+static int term_y = -1, term_x = -1;
+static int term_pair = -1, term_attr = -1;
+static int term_cursor = -1;
+
+/* Output buffer */
+
+static int out_reserve(size_t n)
+{
+	size_t cap = out_cap ? out_cap : 16384;
+	char *p;
+
+	if (out_len + n <= out_cap)
+		return 0;
+
+	while (cap < out_len + n)
+		cap *= 2;
+
+	p = realloc(out, cap);
+	if (!p) {
+		out_failed = 1;
+		return -1;
+	}
+
+	out = p;
+	out_cap = cap;
+	return 0;
+}
+
+static void out_put(const char *s, size_t n)
+{
+	if (out_reserve(n) != 0)
+		return;
+	memcpy(out + out_len, s, n);
+	out_len += n;
+}
+
+static void out_utf8(uint32_t ch)
+{
+	char *p;
+
+	if (out_reserve(4) != 0)
+		return;
+	p = out + out_len;
+
+	if (ch < 0x80) {
+		p[0] = (char)ch;
+		out_len += 1;
+	} else if (ch < 0x800) {
+		p[0] = (char)(0xc0 | (ch >> 6));
+		p[1] = (char)(0x80 | (ch & 0x3f));
+		out_len += 2;
+	} else if (ch < 0x10000) {
+		p[0] = (char)(0xe0 | (ch >> 12));
+		p[1] = (char)(0x80 | ((ch >> 6) & 0x3f));
+		p[2] = (char)(0x80 | (ch & 0x3f));
+		out_len += 3;
+	} else {
+		p[0] = (char)(0xf0 | (ch >> 18));
+		p[1] = (char)(0x80 | ((ch >> 12) & 0x3f));
+		p[2] = (char)(0x80 | ((ch >> 6) & 0x3f));
+		p[3] = (char)(0x80 | (ch & 0x3f));
+		out_len += 4;
+	}
+}
+
+/* write all of @s, returns the number of write calls it took */
+static int write_all(const char *s, size_t len)
+{
+	size_t off = 0;
+	int writes = 0;
+
+	while (off < len) {
+		ssize_t n = write(STDOUT_FILENO, s + off, len - off);
+
+		writes++;
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			out_failed = 1;
+			break;
+		}
+		off += (size_t)n;
+	}
+
+	return writes;
+}
+
+static void out_flush(void)
+{
+	int writes = write_all(out, out_len);
+
+	win_comp_stats.frames++;
+	win_comp_stats.bytes += out_len;
+	win_comp_stats.writes += writes;
+	win_comp_stats.frame_bytes = out_len;
+	win_comp_stats.frame_writes = writes;
+	out_len = 0;
+}
+
+/* Grids */
+
+/**
+ * win_comp_invalidate - Forget what the terminal shows, repaint it all
+ */
+void win_comp_invalidate(void)
+{
+	for (int i = 0; front && i < grid_h * grid_w; i++)
+		front[i].c.ch = COMP_NONE;
+
+	need_clear = 1;
+	term_y = term_x = -1;
+	term_pair = term_attr = -1;
+	term_cursor = -1;
+}
+
+static int grid_resize(void)
+{
+	size_t n = (size_t)LINES * (size_t)COLS;
+	comp_cell_t *f, *b;
+	cchar_t *r;
+
+	if (front && grid_h == LINES && grid_w == COLS)
+		return 0;
+
+	f = malloc(n * sizeof(comp_cell_t));
+	b = malloc(n * sizeof(comp_cell_t));
+	r = malloc(((size_t)COLS + 1) * sizeof(cchar_t));
+	if (!f || !b || !r) {
+		free(f);
+		free(b);
+		free(r);
+		return -1;
+	}
+
+	free(front);
+	free(back);
+	free(rowbuf);
+	front = f;
+	back = b;
+	rowbuf = r;
+	grid_h = LINES;
+	grid_w = COLS;
+
+	win_comp_invalidate();
+	return 0;
+}
+
+/*
+ * ACS_* glyphs are kept as their VT100 character with A_ALTCHARSET, the
+ * grid is written as UTF-8 so they become the code points ncurses would
+ * map them to. 0 where there is none.
+ */
+static const uint16_t acs_utf[128] = {
+	['+'] = 0x2192, [','] = 0x2190, ['-'] = 0x2191, ['.'] = 0x2193,
+	['0'] = 0x2588, ['`'] = 0x25c6, ['a'] = 0x2592, ['f'] = 0x00b0,
+	['g'] = 0x00b1, ['h'] = 0x2591, ['i'] = 0x2603, ['j'] = 0x2518,
+	['k'] = 0x2510, ['l'] = 0x250c, ['m'] = 0x2514, ['n'] = 0x253c,
+	['o'] = 0x23ba, ['p'] = 0x23bb, ['q'] = 0x2500, ['r'] = 0x23bc,
+	['s'] = 0x23bd, ['t'] = 0x251c, ['u'] = 0x2524, ['v'] = 0x2534,
+	['w'] = 0x252c, ['x'] = 0x2502, ['y'] = 0x2264, ['z'] = 0x2265,
+	['{'] = 0x03c0, ['|'] = 0x2260, ['}'] = 0x00a3, ['~'] = 0x00b7,
+};
+
+static inline uint16_t attr_fold(attr_t a)
+{
+	uint16_t f = 0;
+
+	if (a & (A_BOLD | A_STANDOUT))
+		f |= COMP_A_BOLD;
+	if (a & A_DIM)
+		f |= COMP_A_DIM;
+#ifdef A_ITALIC
+	if (a & A_ITALIC)
+		f |= COMP_A_ITALIC;
+#endif
+	if (a & A_UNDERLINE)
+		f |= COMP_A_UNDERLINE;
+	if (a & A_BLINK)
+		f |= COMP_A_BLINK;
+	if (a & (A_REVERSE | A_STANDOUT))
+		f |= COMP_A_REVERSE;
+	if (a & A_INVIS)
+		f |= COMP_A_INVIS;
+
+	return f;
+}
+
+static inline void cell_pack(comp_cell_t *d, const cchar_t *cc)
+{
+	uint32_t ch;
+	attr_t a;
+	int pair;
+
+#ifdef NCURSES_VERSION
+	ch = (uint32_t)cc->chars[0];
+	a = cc->attr;
+#ifdef NCURSES_EXT_COLORS
+	pair = cc->ext_color ? cc->ext_color : (int)PAIR_NUMBER(a);
+#else
+	pair = PAIR_NUMBER(a);
+#endif
+#else
+	wchar_t wch[CCHARW_MAX + 1];
+	short sp;
+
+	getcchar(cc, wch, &a, &sp, NULL);
+	ch = (uint32_t)wch[0];
+	pair = sp;
+#endif
+
+	if ((a & A_ALTCHARSET) && ch < 128 && acs_utf[ch])
+		ch = acs_utf[ch];
+
+	d->c.ch = (ch < ' ' || ch == 0x7f) ? ' ' : ch;
+	d->c.pair = (uint16_t)pair;
+	d->c.attr = attr_fold(a);
+}
+
+/* the right half of a wide character becomes COMP_CONT */
+static void row_pack(comp_cell_t *d, const cchar_t *src, int n)
+{
+	for (int i = 0; i < n; i++) {
+		cell_pack(&d[i], &src[i]);
+
+		if (d[i].c.ch >= 0x1100 && i + 1 < n &&
+		    wcwidth((wchar_t)d[i].c.ch) == 2) {
+			d[i + 1] = d[i];
+			d[i + 1].c.ch = COMP_CONT;
+			i++;
+		}
+	}
+}
+
+/* copy a WINDOW where its panel sits, clipped to the screen */
+static void comp_window(WINDOW *wp)
+{
+	int by, bx, h, w;
+
+	getbegyx(wp, by, bx);
+	getmaxyx(wp, h, w);
+
+	for (int r = 0; r < h; r++) {
+		int y = by + r;
+		int x0 = (bx < 0) ? -bx : 0;
+		int x1 = (bx + w > grid_w) ? grid_w - bx : w;
+
+		if (y < 0 || y >= grid_h || x1 <= x0)
+			continue;
+
+		if (mvwin_wchnstr(wp, r, x0, rowbuf, x1 - x0) == ERR)
+			continue;
+		row_pack(&back[y * grid_w + bx + x0], rowbuf, x1 - x0);
+	}
+}
+
+/* Escape sequences */
+
+static void emit_move(int y, int x)
+{
+	char buf[32];
+	int n;
+
+	if (y == term_y && x == term_x)
+		return;
+
+	if (y == term_y && term_x >= 0 && x > term_x)
+		n = snprintf(buf, sizeof(buf), "\033[%dC", x - term_x);
+	else
+		n = snprintf(buf, sizeof(buf), "\033[%d;%dH", y + 1, x + 1);
+
+	out_put(buf, (size_t)n);
+	term_y = y;
+	term_x = x;
+}
+
+static int color_sgr(char *buf, int c, int base)
+{
+	if (c < 0)
+		return 0;
+
+	if (WIN_COLOR_DIRECT && c >= 8)
+		return sprintf(buf, ";%d;2;%d;%d;%d", base + 8, (c >> 16) & 0xff,
+			       (c >> 8) & 0xff, c & 0xff);
+	if (c < 8)
+		return sprintf(buf, ";%d", base + c);
+	if (c < 16)
+		return sprintf(buf, ";%d", base + 60 + c - 8);
+
+	return sprintf(buf, ";%d;5;%d", base + 8, c);
+}
+
+static void emit_sgr(int pair, int attr)
+{
+	static const struct {
+		int bit;
+		const char *sgr;
+	} attrs[] = {
+		{ COMP_A_BOLD, ";1" }, { COMP_A_DIM, ";2" },
+		{ COMP_A_ITALIC, ";3" }, { COMP_A_UNDERLINE, ";4" },
+		{ COMP_A_BLINK, ";5" }, { COMP_A_REVERSE, ";7" },
+		{ COMP_A_INVIS, ";8" },
+	};
+	char buf[96];
+	int n, fg, bg;
+
+	if (pair == term_pair && attr == term_attr)
+		return;
+
+#ifdef NCURSES_EXT_COLORS
+	if (extended_pair_content(pair, &fg, &bg) == ERR)
+		fg = bg = -1;
+#else
+	{
+		short sf, sb;
+
+		if (pair_content((short)pair, &sf, &sb) == ERR)
+			sf = sb = -1;
+		fg = sf;
+		bg = sb;
+	}
+#endif
+
+	n = sprintf(buf, "\033[0");
+	for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++)
+		if (attr & attrs[i].bit)
+			n += sprintf(buf + n, "%s", attrs[i].sgr);
+	n += color_sgr(buf + n, fg, 30);
+	n += color_sgr(buf + n, bg, 40);
+	buf[n++] = 'm';
+
+	out_put(buf, (size_t)n);
+	term_pair = pair;
+	term_attr = attr;
+}
+
+static void emit_cursor(int show)
+{
+	if (show == term_cursor)
+		return;
+
+	out_put(show ? "\033[?25h" : "\033[?25l", 6);
+	term_cursor = show;
+}
+
+/* write b[x], returns the number of columns it took */
+static int emit_cell(const comp_cell_t *b, int x)
+{
+	uint32_t ch = b[x].c.ch;
+	int width = 1;
+
+	/* half of a wide character under another window is a blank */
+	if (ch == COMP_CONT) {
+		ch = ' ';
+	} else if (ch >= 0x1100 && wcwidth((wchar_t)ch) == 2) {
+		if (x + 1 < grid_w && b[x + 1].c.ch == COMP_CONT)
+			width = 2;
+		else
+			ch = ' ';
+	}
+
+	emit_sgr(b[x].c.pair, b[x].c.attr);
+	out_utf8(ch);
+	win_comp_stats.cells++;
+
+	/* pending wrap at the right margin, position it again next time */
+	term_x += width;
+	if (term_x >= grid_w)
+		term_x = term_y = -1;
+
+	return width;
+}
+
+static inline int row_same(const comp_cell_t *a, const comp_cell_t *b, int n)
+{
+	for (int i = 0; i < n; i++)
+		if (a[i].word != b[i].word)
+			return 0;
+	return 1;
+}
+
+static inline int cell_is_wide(const comp_cell_t *b, int x)
+{
+	return b[x].c.ch >= 0x1100 && b[x].c.ch < COMP_NONE &&
+	    wcwidth((wchar_t)b[x].c.ch) == 2;
+}
+
+/* bring row @y of the terminal in line with the back grid */
+static void comp_row(int y)
+{
+	comp_cell_t *b = &back[y * grid_w];
+	comp_cell_t *f = &front[y * grid_w];
+	int x = 0;
+
+	if (row_same(b, f, grid_w))
+		return;
+
+	/* keep the cursor out of sight while cells are written */
+	if (!sync_update)
+		emit_cursor(0);
+
+	while (x < grid_w) {
+		int start, end;
+
+		if (b[x].word == f[x].word) {
+			x++;
+			continue;
+		}
+
+		/* a right half is drawn by writing its left half */
+		if (b[x].c.ch == COMP_CONT && x > 0 && cell_is_wide(b, x - 1))
+			x--;
+
+		/* short unchanged gaps are cheaper to rewrite than to jump */
+		end = x + 1;
+		for (int j = end; j < grid_w && j - end < COMP_GAP; j++)
+			if (b[j].word != f[j].word)
+				end = j + 1;
+
+		emit_move(y, x);
+		start = x;
+		while (x < end)
+			x += emit_cell(b, x);
+
+		memcpy(&f[start], &b[start], (size_t)(x - start) * sizeof(comp_cell_t));
+	}
+}
+
+/* Compositor */
+
+/**
+ * win_comp_init - Let ncurses keep its hands off the screen
+ * getch() still refreshes stdscr, with leaveok and nothing touched that
+ * refresh writes nothing.
+ */
+void win_comp_init(void)
+{
+	leaveok(stdscr, TRUE);
+	win_comp_invalidate();
+}
+
+/**
+ * win_comp_present - Composite the window stack and write the difference
+ */
+void win_comp_present(void)
+{
+	cosh_win_t *f = (wm.focus_idx >= 0) ? wm.stack[wm.focus_idx] : NULL;
+	int show = 0, cy = 0, cx = 0;
+
+	if (grid_resize() != 0)
+		return;
+
+	comp_window(stdscr);
+	for (int i = 0; i < wm.count; i++)
+		comp_window(wm.stack[i]->ptr);
+	untouchwin(stdscr);
+
+	if (sync_update)
+		out_put(SYNC_BEGIN, sizeof(SYNC_BEGIN) - 1);
+
+	if (f && f->show_cursor) {
+		getbegyx(f->ptr, cy, cx);
+		cy += getcury(f->ptr);
+		cx += getcurx(f->ptr);
+		show = cy >= 0 && cy < grid_h && cx >= 0 && cx < grid_w;
+	}
+
+	if (need_clear) {
+		out_put("\033[0m\033[H\033[2J", 11);
+		term_y = term_x = 0;
+		term_pair = term_attr = -1;
+		need_clear = 0;
+	}
+
+	for (int y = 0; y < grid_h; y++)
+		comp_row(y);
+
+	if (show) {
+		emit_move(cy, cx);
+		emit_cursor(1);
+	} else {
+		emit_cursor(0);
+	}
+
+	if (sync_update && out_len == sizeof(SYNC_BEGIN) - 1)
+		out_len = 0;
+	else if (sync_update)
+		out_put(SYNC_END, sizeof(SYNC_END) - 1);
+
+	if (out_len > 0)
+		out_flush();
+
+	/* whatever did not make it out is repainted next frame */
+	if (out_failed) {
+		out_failed = 0;
+		out_len = 0;
+		win_comp_invalidate();
+	}
+}
+
+/* Synchronized updates */
+
+/*
+ * Panels path: ncurses does the writing, so the frame is measured by
+ * the write counters of the main thread around doupdate(). Nothing else
+ * writes on this thread in between.
+ */
+static int io_fd = -1;
+static unsigned long io_bytes0, io_writes0;
+
+static int io_counters(unsigned long *bytes, unsigned long *writes)
+{
+	char buf[256], *p;
+	ssize_t n;
+
+	if (io_fd < 0)
+		return -1;
+
+	n = pread(io_fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+
+	p = strstr(buf, "wchar:");
+	if (!p || sscanf(p, "wchar: %lu", bytes) != 1)
+		return -1;
+	p = strstr(buf, "syscw:");
+	if (!p || sscanf(p, "syscw: %lu", writes) != 1)
+		return -1;
+	return 0;
+}
+
+/**
+ * win_sync_init - Decide whether frames are sent as synchronized updates
+ * [desktop] sync_update below 0 follows the terminfo Sync capability.
+ */
+void win_sync_init(void)
+{
+	int mode = wm.configs.desktop.sync_update;
+
+	if (io_fd < 0)
+		io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+
+	if (mode < 0) {
+		char *cap = tigetstr("Sync");
+
+		mode = cap && cap != (char *)-1;
+	}
+
+	sync_update = mode > 0;
+}
+
+/**
+ * win_sync_begin - Open a synchronized update around doupdate()
+ * putp() queues it in ncurses' own buffer, ahead of the frame.
+ */
+void win_sync_begin(void)
+{
+	if (io_counters(&io_bytes0, &io_writes0) != 0)
+		io_writes0 = ULONG_MAX;
+
+	if (sync_update)
+		putp(SYNC_BEGIN);
+}
+
+/*
+ * doupdate() has flushed, so this lands right after the frame. It is a
+ * write of its own, a panels frame with sync_update takes two.
+ */
+void win_sync_end(void)
+{
+	unsigned long bytes, writes;
+
+	if (sync_update)
+		write_all(SYNC_END, sizeof(SYNC_END) - 1);
+
+	if (io_writes0 == ULONG_MAX || io_counters(&bytes, &writes) != 0 ||
+	    writes == io_writes0)
+		return;
+
+	win_comp_stats.frames++;
+	win_comp_stats.bytes += bytes - io_bytes0;
+	win_comp_stats.writes += writes - io_writes0;
+	win_comp_stats.frame_bytes = bytes - io_bytes0;
+	win_comp_stats.frame_writes = (int)(writes - io_writes0);
+}
@@ -0,0 +1,27 @@
+#ifndef WMCOMP_H
+#define WMCOMP_H
+
+/* [desktop] compositor */
+#define WIN_COMP_PANELS	0	/* ncurses panels and doupdate */
+#define WIN_COMP_GRID	1	/* own cell grids, see wmcomp.c */
+
+/* terminal output counters, of either compositor */
+typedef struct {
+	unsigned long frames;	/* frames that wrote anything */
+	unsigned long cells;	/* cells sent to the terminal */
+	unsigned long bytes;	/* bytes sent to the terminal */
+	unsigned long writes;	/* write calls it took */
+	size_t frame_bytes;	/* of the last frame */
+	int frame_writes;	/* of the last frame */
+} win_comp_stats_t;
+
+extern win_comp_stats_t win_comp_stats;
+
+void win_comp_init(void);
+void win_comp_invalidate(void);
+void win_comp_present(void);
+void win_sync_init(void);
+void win_sync_begin(void);
+void win_sync_end(void);
+
+#endif				/* WMCOMP_H */
@@ -1,5 +1,6 @@
 #include "wmcurses.h"
 #include "cosh.h"
+#include "Core/hist.h"
 
 /* Mouse Wheel definitions */
 #ifndef BUTTON4_PRESSED
@@ -24,14 +25,19 @@ cosh_wm_t wm = {
 
 win_buffreq_t win_buffer_request;
 int win_needs_redraw = 1;
+static int status_dirty = 1;	/* only the statusbar changed */
 int win_force_full = 0;
-volatile sig_atomic_t terminal_resized = 0;
+unsigned long win_frame_seq = 0;	/* bumped at every frame deadline */
+static uint64_t next_frame_us = 0;
+static int frame_held = 0;	/* a redraw waited for next_frame_us */
 
-void handle_sigwinch(int sig)
-{
-	(void)sig;
-	terminal_resized = 1;
-}
+/* windows with a ready poll_fd, served by win_sched_run() */
+static cosh_win_t *run_queue[WIN_MAX];
+static int run_count = 0;
+static cosh_win_t *sched_current = NULL;	/* window inside tick_cb */
+static uint64_t sched_start = 0;
+
+static int wm_on_clock(c_watch_t *wt, uint32_t events);
 
 /**
  * win_apply_colors - Assign and initialize color pairs for a window
@@ -73,7 +79,7 @@ void wm_init(void)
 	use_default_colors();
 	set_escdelay(10);
 
-	signal(SIGWINCH, handle_sigwinch);
+	c_proc_on_resize(win_handle_resize);
 
 	if (can_change_color())
 		init_color(COLOR_HDR_BLUE, 0, 0, 666);
@@ -83,6 +89,10 @@ void wm_init(void)
 	printf("\033[?1002h\n");
 	fflush(stdout);
 
+	wm_on_clock(NULL, 0);
+	if (!c_loop_timer(wm.configs.desktop.refresh_rate, wm_on_clock, NULL))
+		c_log_warn("Statusbar clock is disabled.");
+
 	cosh_wm_config_t config = wm.configs;
 
 	init_pair(CP_WIN_BG, config.colorscheme.desktop, config.colorscheme.desktop);
@@ -98,6 +108,10 @@ void wm_init(void)
 
 	wbkgd(stdscr, COLOR_PAIR(CP_TOS_STD));
 
+	win_sync_init();
+	if (wm.configs.desktop.compositor == WIN_COMP_GRID)
+		win_comp_init();
+
 	//default colors 
 	wm.configs.show_border = 1;
 }
@@ -159,6 +173,7 @@ cosh_win_t *win_create(int h, int w, int flags)
 	win->dirty = 1;
 	win->fg = -1;
 	win->bg = -1;
+	win->poll_fd = -1;
 
 	keypad(win->ptr, TRUE);
 	scrollok(win->ptr, TRUE);
@@ -227,7 +242,6 @@ void win_handle_resize(void)
 
 	getmaxyx(stdscr, LINES, COLS);
 
-	terminal_resized = 0;
 	win_force_full = 1;
 
 	for (int i = 0; i < wm.count; i++) {
@@ -264,6 +278,104 @@ void win_handle_resize(void)
 	win_needs_redraw = 1;
 }
 
+static void run_push(cosh_win_t *win)
+{
+	win->io_queued = 1;
+	run_queue[run_count++] = win;
+}
+
+static void run_remove(int i)
+{
+	run_queue[i]->io_queued = 0;
+	for (; i < run_count - 1; i++)
+		run_queue[i] = run_queue[i + 1];
+	run_count--;
+}
+
+/**
+ * win_on_poll - Event loop callback for a window's poll_fd
+ * Only queues the window, win_sched_run() decides when tick_cb runs.
+ */
+static int win_on_poll(c_watch_t *wt, uint32_t events)
+{
+	cosh_win_t *win = (cosh_win_t *) wt->data;
+	(void)events;
+
+	if (win->tick_cb && !win->io_queued)
+		run_push(win);
+
+	return LOOP_DONE;
+}
+
+static void win_set_poll_fd(cosh_win_t *win, int fd)
+{
+	if (win->watch) {
+		c_loop_del(win->watch);
+		win->watch = NULL;
+	}
+
+	win->poll_fd = fd;
+	if (fd >= 0)
+		win->watch = c_loop_add(fd, EPOLLIN | EPOLLET, win_on_poll, win);
+}
+
+static int win_on_timer(c_watch_t *wt, uint32_t events)
+{
+	cosh_win_t *win = (cosh_win_t *) wt->data;
+	(void)events;
+
+	if (win->timer_cb)
+		win->timer_cb(win);
+
+	return LOOP_DONE;
+}
+
+static void win_set_timer(cosh_win_t *win, int period_ms, timer_fn cb)
+{
+	if (win->timer) {
+		c_loop_del(win->timer);
+		win->timer = NULL;
+	}
+
+	win->timer_cb = cb;
+	if (period_ms > 0 && cb)
+		win->timer = c_loop_timer(period_ms, win_on_timer, win);
+}
+
+/**
+ * win_watch - Register an additional fd owned by the window
+ * The watch's data points to @win and it is removed with the window.
+ */
+c_watch_t *win_watch(cosh_win_t *win, int fd, uint32_t events, watch_fn cb)
+{
+	if (!win)
+		return NULL;
+
+	for (int i = 0; i < WIN_WATCH_MAX; i++) {
+		if (win->watches[i])
+			continue;
+
+		win->watches[i] = c_loop_add(fd, events, cb, win);
+		return win->watches[i];
+	}
+
+	return NULL;
+}
+
+void win_unwatch(cosh_win_t *win, c_watch_t *wt)
+{
+	if (!win || !wt)
+		return;
+
+	for (int i = 0; i < WIN_WATCH_MAX; i++) {
+		if (win->watches[i] == wt) {
+			c_loop_del(wt);
+			win->watches[i] = NULL;
+			return;
+		}
+	}
+}
+
 /**
  * win_setopt - Set window options/callbacks
  */
@@ -293,6 +405,9 @@ void win_setopt(cosh_win_t *win, win_opt_t opt, ...)
 	case WIN_OPT_RENDER:
 		win->render_cb = va_arg(ap, render_fn);
 		break;
+	case WIN_OPT_RENDER_RECT:
+		win->render_rect_cb = va_arg(ap, render_rect_fn);
+		break;
 	case WIN_OPT_INPUT:
 		win->input_cb = va_arg(ap, input_fn);
 		break;
@@ -321,64 +436,111 @@ void win_setopt(cosh_win_t *win, win_opt_t opt, ...)
 	case WIN_OPT_CURSOR:
 		win->show_cursor = va_arg(ap, int);
 		break;
+	case WIN_OPT_POLLFD:
+		win_set_poll_fd(win, va_arg(ap, int));
+		break;
+	case WIN_OPT_TIMER:{
+			int period_ms = va_arg(ap, int);
+			win_set_timer(win, period_ms, va_arg(ap, timer_fn));
+			break;
+		}
+	case WIN_OPT_MODAL:
+		win->modal_cb = va_arg(ap, modal_fn);
+		win->modal_data = va_arg(ap, void *);
+		win->modal_result = WIN_MODAL_CANCEL;
+		if (wm.modal != win) {
+			win->modal_prev = wm.modal;
+			wm.modal = win;
+		}
+		if (idx != -1)
+			win_raise(idx);
+		break;
 	}
 	va_end(ap);
 	win->dirty = 1;
 }
 
+/* border glyphs, in wborder_set order */
+enum { FRAME_FOCUSED, FRAME_PLAIN, FRAME_HIDDEN, FRAME_STYLES };
+
+static cchar_t frame_glyphs[FRAME_STYLES][8];
+static cchar_t frame_scroll;
+static int frame_glyphs_ready = 0;
+
+static void frame_glyphs_init(void)
+{
+	static const wchar_t *const glyphs[FRAME_STYLES][8] = {
+		{L"║", L"║", L"═", L"═", L"╔", L"╗", L"╚", L"╝"},
+		{L"│", L"│", L"─", L"─", L"┌", L"┐", L"└", L"┘"},
+		{L" ", L" ", L" ", L" ", L" ", L" ", L" ", L" "},
+	};
+
+	for (int i = 0; i < FRAME_STYLES; i++)
+		for (int j = 0; j < 8; j++)
+			SET_CHW(frame_glyphs[i][j], glyphs[i][j]);
+	SET_CHW(frame_scroll, L"▒");
+	frame_glyphs_ready = 1;
+}
+
 /**
  * win_render_frame - Draw borders and title
+ * Retained: nothing is emitted unless an input of the frame changed or
+ * the window was erased since it was last drawn.
  */
 static void win_render_frame(cosh_win_t *win, int is_focused)
 {
+	win_frame_state_t st;
 	int hdr_color = is_focused ? CP_TOS_HDR : CP_TOS_HDR_UNF;
+	int style;
+	cchar_t *g;
+
+	memset(&st, 0, sizeof(st));
+	st.valid = 1;
+	st.focused = is_focused;
+	st.dragging = win->drag_state.is_dragging;
+	st.border = wm.configs.show_border;
+	st.flash = win->flash;
+	st.locked = (win->flags & WIN_FLAG_LOCKED) != 0;
+	st.color_pair = win->color_pair;
+	st.w = win->w;
+	st.h = win->h;
+	st.scroll_cur = win->scroll_cur;
+	st.scroll_max = win->scroll_max;
+	memcpy(st.title, win->title, sizeof(st.title));
+
+	if (memcmp(&st, &win->frame, sizeof(st)) == 0)
+		return;
+	win->frame = st;
+
+	if (!frame_glyphs_ready)
+		frame_glyphs_init();
 
 	if (win->drag_state.is_dragging)
 		hdr_color = CP_TOS_DRAG;
 
-	cchar_t ls, rs, ts, bs, tl, tr, bl, br;
-
-	if (is_focused && wm.configs.show_border) {
-		SET_CHW(ls, L"║");
-		SET_CHW(rs, (win->scroll_max > 0) ? L"▒" : L"║");
-		SET_CHW(ts, L"═");
-		SET_CHW(bs, L"═");
-		SET_CHW(tl, L"╔");
-		SET_CHW(tr, L"╗");
-		SET_CHW(bl, L"╚");
-		SET_CHW(br, L"╝");
-	} else if (!wm.configs.show_border) {
-		SET_CHW(ls, L" ");
-		SET_CHW(rs, L" ");
-		SET_CHW(ts, L" ");
-		SET_CHW(bs, L" ");
-		SET_CHW(tl, L" ");
-		SET_CHW(tr, L" ");
-		SET_CHW(bl, L" ");
-		SET_CHW(br, L" ");
-	} else {
-		SET_CHW(ls, L"│");
-		SET_CHW(rs, (win->scroll_max > 0) ? L"▒" : L"│");
-		SET_CHW(ts, L"─");
-		SET_CHW(bs, L"─");
-		SET_CHW(tl, L"┌");
-		SET_CHW(tr, L"┐");
-		SET_CHW(bl, L"└");
-		SET_CHW(br, L"┘");
-	}
+	if (!wm.configs.show_border)
+		style = FRAME_HIDDEN;
+	else
+		style = is_focused ? FRAME_FOCUSED : FRAME_PLAIN;
+	g = frame_glyphs[style];
+
+	if (win->flash)
+		wattron(win->ptr, A_REVERSE);
 
 	wattron(win->ptr, COLOR_PAIR(win->color_pair));
-	wborder_set(win->ptr, &ls, &rs, &ts, &bs, &tl, &tr, &bl, &br);
+	wborder_set(win->ptr, &g[0],
+		    (win->scroll_max > 0
+		     && style != FRAME_HIDDEN) ? &frame_scroll : &g[1], &g[2],
+		    &g[3], &g[4], &g[5], &g[6], &g[7]);
 
 	wattron(win->ptr, COLOR_PAIR(hdr_color));
-	for (int i = 1; i < win->w - 1; i++)
-		mvwaddch(win->ptr, 0, i, ' ');
+	mvwhline(win->ptr, 0, 1, ' ', win->w - 2);
 
 	//render title, truncation
-	//5 for [ X ]
-	char title_buf[win->vw - 5];
-	memcpy(title_buf, win->title, sizeof(title_buf) - 1);
-	mvwprintw(win->ptr, 0, 2, " %s ", title_buf);
+	//6 for [ X ] and the padding around the title
+	int title_max = win->w - 10;
+	if (title_max > 0)
+		mvwprintw(win->ptr, 0, 2, " %.*s ", title_max, win->title);
 
 	if (!(win->flags & WIN_FLAG_LOCKED)) {
 		wattron(win->ptr, COLOR_PAIR(CP_TOS_ACC));
@@ -403,6 +565,8 @@ static void win_render_frame(cosh_win_t *win, int is_focused)
 
 		mvwaddstr(win->ptr, bar_y, bar_x, "█");
 	}
+
+	wattroff(win->ptr, A_REVERSE);
 }
 
 /**
@@ -414,6 +578,10 @@ void win_raise(int idx)
 	if (idx < 0 || idx >= wm.count)
 		return;
 
+	/* the modal stays on top until it is closed */
+	if (wm.modal && wm.stack[idx] != wm.modal)
+		return;
+
 	if (idx != wm.count - 1) {
 		tmp = wm.stack[idx];
 		for (int i = idx; i < wm.count - 1; i++)
@@ -424,8 +592,126 @@ void win_raise(int idx)
 	wm.focus_idx = wm.count - 1;
 	top_panel(wm.stack[wm.focus_idx]->panel);
 
-	for (int i = 0; i < wm.count; i++)
-		wm.stack[i]->dirty = 1;
+	/* contents did not change, the panel library recomposes the overlap */
+	win_needs_redraw = 1;
+}
+
+/* Animations */
+
+typedef struct {
+	cosh_win_t *win;
+	win_keyframe_t keys[WIN_ANIM_KEYS];
+	int n;
+	int flags;
+	uint64_t start_us;
+} win_anim_t;
+
+static win_anim_t anims[WIN_ANIM_MAX];
+static int anim_count = 0;
+
+static const win_keyframe_t anim_shake[] = {
+	{0, 0, -1, 0},
+	{30, 0, 1, 0},
+	{60, 0, -1, 0},
+	{90, 0, 1, 0},
+	{120, 0, 0, 0},
+};
+
+static const win_keyframe_t anim_flash[] = {
+	{0, 0, 0, 1},
+	{60, 0, 0, 0},
+	{120, 0, 0, 1},
+	{180, 0, 0, 0},
+};
+
+static void anim_remove(int i)
+{
+	cosh_win_t *w = anims[i].win;
+
+	/* back to the resting place */
+	move_panel(w->panel, w->y, w->x);
+	w->flash = 0;
+	win_needs_redraw = 1;
+
+	anims[i] = anims[--anim_count];
+}
+
+void win_anim_cancel(cosh_win_t *win)
+{
+	for (int i = 0; i < anim_count; i++) {
+		if (anims[i].win == win) {
+			anim_remove(i);
+			return;
+		}
+	}
+}
+
+/**
+ * win_animate - Play @n keyframes on @win, replacing its running animation
+ * The animation only displaces the panel, win->y and win->x keep the
+ * resting place. It is advanced by win_frame(), nothing here sleeps.
+ */
+int win_animate(cosh_win_t *win, const win_keyframe_t *kf, int n, int flags)
+{
+	win_anim_t *a;
+
+	if (!win || !kf || n <= 0 || n > WIN_ANIM_KEYS)
+		return -1;
+
+	win_anim_cancel(win);
+	if (anim_count >= WIN_ANIM_MAX)
+		return -1;
+
+	a = &anims[anim_count++];
+	a->win = win;
+	memcpy(a->keys, kf, sizeof(win_keyframe_t) * n);
+	a->n = n;
+	a->flags = flags;
+	a->start_us = c_loop_now();
+
+	win_needs_redraw = 1;
+	return 0;
+}
+
+/**
+ * win_anim_step - Move every animated panel to where it is at @now
+ */
+static void win_anim_step(uint64_t now)
+{
+	int i = 0;
+
+	while (i < anim_count) {
+		win_anim_t *a = &anims[i];
+		int t = (int)((now - a->start_us) / 1000);
+		int k = 0;
+		int dy, dx;
+
+		if (t >= a->keys[a->n - 1].at_ms) {
+			anim_remove(i);
+			continue;
+		}
+
+		while (k + 1 < a->n && a->keys[k + 1].at_ms <= t)
+			k++;
+
+		dy = a->keys[k].dy;
+		dx = a->keys[k].dx;
+
+		if ((a->flags & WIN_ANIM_LERP) && k + 1 < a->n) {
+			const win_keyframe_t *p = &a->keys[k], *q = &a->keys[k + 1];
+			int span = q->at_ms - p->at_ms;
+
+			if (span > 0) {
+				dy += (q->dy - p->dy) * (t - p->at_ms) / span;
+				dx += (q->dx - p->dx) * (t - p->at_ms) / span;
+			}
+		}
+
+		move_panel(a->win->panel, a->win->y + dy, a->win->x + dx);
+		a->win->flash = a->keys[k].flash;
+		win_needs_redraw = 1;
+		i++;
+	}
 }
 
 /**
@@ -434,23 +720,20 @@ void win_raise(int idx)
 void win_vibrate(void)
 {
 	beep();
-	if (wm.focus_idx >= 0) {
-		cosh_win_t *w = wm.stack[wm.focus_idx];
-		int orig_x = w->x;
-		int offsets[] = { -1, 1, -1, 1, 0 };
-
-		for (int i = 0; i < 5; i++) {
-			w->x = orig_x + offsets[i];
-			move_panel(w->panel, w->y, w->x);
-			win_refresh_all();
-			usleep(30000);
-		}
-	}
+	if (wm.focus_idx >= 0)
+		win_animate(wm.stack[wm.focus_idx], anim_shake,
+			    sizeof(anim_shake) / sizeof(anim_shake[0]), 0);
 }
 
+/**
+ * win_ding - Visual bell, flashes the focused window frame
+ */
 void win_ding(void)
 {
-	win_vibrate();
+	beep();
+	if (wm.focus_idx >= 0)
+		win_animate(wm.stack[wm.focus_idx], anim_flash,
+			    sizeof(anim_flash) / sizeof(anim_flash[0]), 0);
 }
 
 void win_printf(cosh_win_t *win, const char *fmt, ...)
@@ -481,11 +764,85 @@ void win_attroff(cosh_win_t *win, int pair)
 void win_clear(cosh_win_t *win)
 {
 	werase(win->ptr);
+	win->frame.valid = 0;
 	win->scroll_max = 0;
 	win->scroll_cur = 0;
 	win->dirty = 1;
 }
 
+/**
+ * win_input - Hand @ch to the window's input_cb
+ * Windows with a render_rect_cb mark their own damage, a key is not a
+ * reason to repaint them whole. Others get a full repaint.
+ */
+void win_input(cosh_win_t *win, int ch, MEVENT *ev)
+{
+	/* before the call, input_cb may destroy win */
+	if (!win->render_rect_cb)
+		win->dirty = 1;
+	win->input_cb(win, ch, ev);
+}
+
+/**
+ * win_mark_dirty_rect - Repaint only @h rows and @w columns from (@y, @x)
+ * Rects accumulate into their bounding box until the next frame. Windows
+ * without a render_rect_cb get a full repaint instead.
+ */
+void win_mark_dirty_rect(cosh_win_t *win, int y, int x, int h, int w)
+{
+	win_rect_t *d = &win->dirty_rect;
+	int y1 = y + h, x1 = x + w;
+
+	if (y < 0)
+		y = 0;
+	if (x < 0)
+		x = 0;
+	if (y1 > win->vh)
+		y1 = win->vh;
+	if (x1 > win->vw)
+		x1 = win->vw;
+	if (y >= y1 || x >= x1)
+		return;
+
+	if (d->h > 0) {
+		if (d->y + d->h > y1)
+			y1 = d->y + d->h;
+		if (d->x + d->w > x1)
+			x1 = d->x + d->w;
+		if (d->y < y)
+			y = d->y;
+		if (d->x < x)
+			x = d->x;
+	}
+
+	d->y = y;
+	d->x = x;
+	d->h = y1 - y;
+	d->w = x1 - x;
+	win_needs_redraw = 1;
+}
+
+/**
+ * win_scroll - Move viewport rows [@y, @y + @h) up by @n lines, down if negative
+ * The border columns move along and the frame is redrawn. Lines coming
+ * in are blank for the caller to paint. Returns -1 when the rows cannot
+ * be moved in place, e.g. rows hidden behind other windows were skipped.
+ */
+int win_scroll(cosh_win_t *win, int y, int h, int n)
+{
+	if (!win || h <= 0 || y < 0 || y + h > win->vh || win->stale ||
+	    win->dirty)
+		return -1;
+
+	if (wsetscrreg(win->ptr, y + 1, y + h) == ERR)
+		return -1;
+	wscrl(win->ptr, n);
+	wsetscrreg(win->ptr, 0, win->h - 1);
+
+	win->frame.valid = 0;
+	return 0;
+}
+
 /**
  * win_toggle_fullscreen - Maximize/Restore window
  */
@@ -528,6 +885,9 @@ void win_toggle_fullscreen(cosh_win_t *win)
 void win_destroy(cosh_win_t *win)
 {
 	int idx = -1;
+	modal_fn modal_cb;
+	void *modal_data;
+	int modal_result;
 
 	for (int i = 0; i < wm.count; i++)
 		if (wm.stack[i] == win)
@@ -536,6 +896,34 @@ void win_destroy(cosh_win_t *win)
 	if (idx < 0 || idx >= wm.count)
 		return;
 
+	modal_cb = win->modal_cb;
+	modal_data = win->modal_data;
+	modal_result = win->modal_result;
+
+	for (int i = 0; i < run_count; i++)
+		if (run_queue[i] == win)
+			run_remove(i);
+	if (sched_current == win)
+		sched_current = NULL;
+	win_anim_cancel(win);
+
+	if (modal_cb) {
+		cosh_win_t **pp = &wm.modal;
+
+		while (*pp && *pp != win)
+			pp = &(*pp)->modal_prev;
+		if (*pp)
+			*pp = win->modal_prev;
+	}
+	if (wm.drag_win == win)
+		wm.drag_win = NULL;
+
+	/* unregister before the app closes its fds */
+	win_set_poll_fd(win, -1);
+	win_set_timer(win, 0, NULL);
+	for (int i = 0; i < WIN_WATCH_MAX; i++)
+		win_unwatch(win, win->watches[i]);
+
 	if (wm.stack[idx]->destroy_cb)
 		wm.stack[idx]->destroy_cb(wm.stack[idx]->priv);
 	else if (wm.stack[idx]->priv)
@@ -556,6 +944,18 @@ void win_destroy(cosh_win_t *win)
 
 	win_needs_redraw = 1;
 
+	/* last, the callback may open another window or even exit */
+	if (modal_cb)
+		modal_cb(modal_result, modal_data);
+}
+
+/**
+ * win_modal_done - Close a modal window and report @result to its owner
+ */
+void win_modal_done(cosh_win_t *win, int result)
+{
+	win->modal_result = result;
+	win_destroy(win);
 }
 
 /**
@@ -563,8 +963,10 @@ void win_destroy(cosh_win_t *win)
  */
 void win_destroy_focused(void)
 {
-	int idx = wm.focus_idx;
-	win_destroy(wm.stack[idx]);
+	if (wm.focus_idx < 0)
+		return;
+
+	win_destroy(wm.stack[wm.focus_idx]);
 }
 
 /**
@@ -630,6 +1032,18 @@ void win_handle_mouse(void)
 		return;		/* dont handle clicks */
 	}
 
+	/* a modal swallows clicks outside of it */
+	if (wm.modal) {
+		cosh_win_t *m = wm.modal;
+
+		if (ev.y < m->y || ev.y >= m->y + m->h ||
+		    ev.x < m->x || ev.x >= m->x + m->w) {
+			if (ev.bstate & (BUTTON1_PRESSED | BUTTON1_CLICKED))
+				win_vibrate();
+			return;
+		}
+	}
+
 	/* Handle mouse */
 	for (int i = wm.count - 1; i >= 0; i--) {
 		cosh_win_t *w = wm.stack[i];
@@ -683,10 +1097,8 @@ void win_handle_mouse(void)
 			}
 
 			/* Dispatch Scroll Event immediatly */
-			if (w->last_seq != WIN_SEQ_NONE && w->input_cb) {
-				w->input_cb(w, (int)w->last_seq, &ev);
-				w->dirty = 1;
-			}
+			if (w->last_seq != WIN_SEQ_NONE && w->input_cb)
+				win_input(w, (int)w->last_seq, &ev);
 
 			win_needs_redraw = 1;
 			return;
@@ -700,81 +1112,257 @@ void win_handle_mouse(void)
 	}
 }
 
+#define STATUS_SEGS	6
+
+/* statusbar fields, drawn left to right while they fit */
+static char status_seg[STATUS_SEGS][64];
+static int status_nseg = 0;
+
 /**
- * draw_statusbar - Render the bottom info bar
+ * wm_on_clock - Statusbar clock, the only periodic wakeup while idle
+ * With show_stats the counters stand in for the usage fields.
  */
-static void draw_statusbar(void)
+static int wm_on_clock(c_watch_t *wt, uint32_t events)
 {
-	static time_t last_s = 0;
-	static int cached_usage = 0;
-	static long cached_rss = 0;
-	static char status_left[128];
-
+	char time_str[16];
 	time_t now = time(NULL);
-	struct tm *t = localtime(&now);
-
-	if (now != last_s) {
-		char time_str[16];
-		strftime(time_str, sizeof(time_str), "%H:%M:%S", t);
+	unsigned long raw = c_hist_stats.raw;
+	unsigned long packed = c_hist_stats.packed;
+	int n = 0;
+	(void)wt;
+	(void)events;
+
+	strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&now));
+	snprintf(status_seg[n++], sizeof(status_seg[0]), " %s", time_str);
+
+	if (!wm.configs.show_stats) {
+		snprintf(status_seg[n++], sizeof(status_seg[0]),
+			 " | Used: %d %ld(kb)", c_get_workdir_usage(),
+			 c_self_get_rss() / 1024);
+		snprintf(status_seg[n++], sizeof(status_seg[0]), " | Open: %d",
+			 wm.count);
+	} else {
+		snprintf(status_seg[n++], sizeof(status_seg[0]),
+			 " | Frames: %lu (%lu merged)", wm.stats.frames,
+			 wm.stats.frames_skipped);
+		snprintf(status_seg[n++], sizeof(status_seg[0]),
+			 " | Out: %zuB in %dw", win_comp_stats.frame_bytes,
+			 win_comp_stats.frame_writes);
+		snprintf(status_seg[n++], sizeof(status_seg[0]),
+			 " | Throttled: %lu(kb)", wm.stats.io_throttled / 1024);
+		snprintf(status_seg[n++], sizeof(status_seg[0]),
+			 " | Pairs: %lu/%lu (%lu evicted, %lu near)",
+			 win_pair_stats.hits,
+			 win_pair_stats.hits + win_pair_stats.misses,
+			 win_pair_stats.evictions, win_pair_stats.fallbacks);
+		snprintf(status_seg[n++], sizeof(status_seg[0]),
+			 " | Hist: %lux (%lu open)", packed ? raw / packed : 1,
+			 c_hist_stats.unpacked);
+	}
+	status_nseg = n;
 
-		cached_usage = c_get_workdir_usage();
-		cached_rss = c_self_get_rss() / 1024;
+	status_dirty = 1;
+	return LOOP_DONE;
+}
 
-		snprintf(status_left, sizeof(status_left),
-			 " %s | Used: %d %ld(kb) | Open: %d", time_str,
-			 cached_usage, cached_rss, wm.count);
-		last_s = now;
-	}
+/**
+ * win_toggle_stats - Switch the statusbar between usage and counters
+ */
+void win_toggle_stats(void)
+{
+	wm.configs.show_stats = !wm.configs.show_stats;
+	wm_on_clock(NULL, 0);
+}
 
+/**
+ * draw_statusbar - Render the bottom info bar
+ */
+static void draw_statusbar(void)
+{
 	char status_right[64];
+	int x = 0, right;
+
 	snprintf(status_right, sizeof(status_right), "[%s] ",
 		 wm.focus_idx >= 0 ? wm.stack[wm.focus_idx]->name : "Desktop");
+	right = COLS - (int)strlen(status_right);
 
 	attron(COLOR_PAIR(CP_TOS_BAR));
 	mvhline(LINES - 1, 0, ' ', COLS);
-	mvaddstr(LINES - 1, 0, status_left);
-	mvaddstr(LINES - 1, COLS - strlen(status_right), status_right);
+	for (int i = 0; i < status_nseg; i++) {
+		int len = (int)strlen(status_seg[i]);
+
+		/* a field is shown whole or not at all */
+		if (x + len > right)
+			break;
+		mvaddstr(LINES - 1, x, status_seg[i]);
+		x += len;
+	}
+	mvaddstr(LINES - 1, right, status_right);
 	attroff(COLOR_PAIR(CP_TOS_BAR));
+	status_dirty = 0;
+}
+
+/* Occlusion */
+
+/**
+ * row_covered - Whether windows from @level up hide columns [x0, x1) of row @y
+ */
+static int row_covered(int level, int y, int x0, int x1)
+{
+	int lo[WIN_MAX], hi[WIN_MAX];
+	int n = 0;
+
+	for (int i = level; i < wm.count; i++) {
+		cosh_win_t *w = wm.stack[i];
+		int j = n++;
+
+		if (y < w->y || y >= w->y + w->h) {
+			n--;
+			continue;
+		}
+
+		/* keep the spans sorted by their left edge */
+		while (j > 0 && lo[j - 1] > w->x) {
+			lo[j] = lo[j - 1];
+			hi[j] = hi[j - 1];
+			j--;
+		}
+		lo[j] = w->x;
+		hi[j] = w->x + w->w;
+	}
+
+	for (int i = 0; i < n && x0 < x1; i++) {
+		if (lo[i] > x0)
+			return 0;
+		if (hi[i] > x0)
+			x0 = hi[i];
+	}
+
+	return x0 >= x1;
+}
+
+/**
+ * win_expose - Find the band of rows of stack[@idx] that can be seen
+ * A window that skipped rows before is repainted when its band changes.
+ */
+static void win_expose(int idx)
+{
+	cosh_win_t *w = wm.stack[idx];
+	int x1 = (w->x + w->w < COLS) ? w->x + w->w : COLS;
+	int y0 = -1, y1 = -1;
+
+	for (int r = 0; r < w->h && w->y + r < LINES; r++) {
+		if (row_covered(idx + 1, w->y + r, w->x, x1))
+			continue;
+		if (y0 < 0)
+			y0 = r;
+		y1 = r + 1;
+	}
+
+	if (y0 < 0)
+		y0 = y1 = 0;
+
+	if (w->stale && (y0 != w->vis_y0 || y1 != w->vis_y1))
+		w->dirty = 1;
+
+	w->vis_y0 = y0;
+	w->vis_y1 = y1;
+}
+
+/**
+ * win_visible_rows - Viewport rows of @win worth rendering, [*y0, *y1)
+ */
+void win_visible_rows(cosh_win_t *win, int *y0, int *y1)
+{
+	*y0 = (win->vis_y0 > 1) ? win->vis_y0 - 1 : 0;
+	*y1 = (win->vis_y1 - 1 < win->vh) ? win->vis_y1 - 1 : win->vh;
+	if (*y1 < *y0)
+		*y1 = *y0;
 }
 
+/* only the rows some part of which no window covers */
 static void draw_desktop(void)
 {
 	attron(COLOR_PAIR(CP_WIN_BG));
 	for (int y = 0; y < LINES - 1; y++)
-		mvhline(y, 0, ' ', COLS);
+		if (!row_covered(0, y, 0, COLS))
+			mvhline(y, 0, ' ', COLS);
 	attroff(COLOR_PAIR(CP_WIN_BG));
 }
 
 /**
  * win_refresh_all - Core redraw loop using panel updates
+ * With the grid compositor the panels are only used for their position.
  */
 void win_refresh_all(void)
 {
+	int grid = wm.configs.desktop.compositor == WIN_COMP_GRID;
+
+	win_pair_frame();
+
 	if (win_force_full) {
-		clearok(stdscr, TRUE);
+		if (grid)
+			win_comp_invalidate();
+		else
+			clearok(stdscr, TRUE);
 		win_force_full = 0;
 	}
 
+	for (int i = 0; i < wm.count; i++)
+		win_expose(i);
+
 	if (win_needs_redraw) {
 		draw_desktop();
 		draw_statusbar();
+	} else if (status_dirty) {
+		draw_statusbar();
 	}
 
-	wnoutrefresh(stdscr);
-	curs_set(0);
+	if (!grid) {
+		wnoutrefresh(stdscr);
+		curs_set(0);
+	}
 
 	for (int i = 0; i < wm.count; i++) {
 		cosh_win_t *w = wm.stack[i];
+		win_rect_t *d = &w->dirty_rect;
+		int partial = w->vis_y0 > 0 || w->vis_y1 < w->h;
+		int vy0, vy1;
+
+		/* fully covered, keep the pending repaint for when it shows */
+		if (w->vis_y0 >= w->vis_y1)
+			continue;
+
+		win_visible_rows(w, &vy0, &vy1);
 
-		if (w->dirty) {
+		if (w->dirty || (d->h > 0 && !w->render_rect_cb)) {
 			werase(w->ptr);
+			w->frame.valid = 0;
 			if (w->render_cb)
 				w->render_cb(w);
-			w->dirty = 0;
+			w->stale = partial;
+		} else if (d->h > 0) {
+			int y1 = (d->y + d->h < vy1) ? d->y + d->h : vy1;
+			win_rect_t r = *d;
+
+			r.y = (d->y > vy0) ? d->y : vy0;
+			r.h = y1 - r.y;
+			if (r.h > 0)
+				w->render_rect_cb(w, r);
+			if (r.h != d->h)
+				w->stale = 1;
 		}
+		w->dirty = 0;
+		d->h = d->w = 0;
 		win_render_frame(w, (i == wm.focus_idx));
 	}
 
+	if (grid) {
+		win_comp_present();
+		win_needs_redraw = 0;
+		return;
+	}
+
 	update_panels();
 
 	if (wm.focus_idx >= 0) {
@@ -786,6 +1374,205 @@ void win_refresh_all(void)
 		}
 	}
 
+	win_sync_begin();
 	doupdate();
+	win_sync_end();
 	win_needs_redraw = 0;
 }
+
+/* Frame scheduler */
+
+static uint64_t win_frame_interval(void)
+{
+	int fps = wm.configs.desktop.max_fps;
+
+	return (fps > 0) ? 1000000ULL / (uint64_t)fps : 0;
+}
+
+static void win_io_refill(cosh_win_t *win)
+{
+	if (win->io_seq == win_frame_seq)
+		return;
+
+	win->io_seq = win_frame_seq;
+	win->io_bytes = 0;
+	win->io_us = 0;
+}
+
+/**
+ * win_io_budget - Bytes @win may still consume in this frame
+ * Returns 0 once either its byte or its time budget is spent.
+ */
+size_t win_io_budget(cosh_win_t *win)
+{
+	int bytes = wm.configs.terminal.io_budget;
+	int us = wm.configs.terminal.io_time;
+
+	win_io_refill(win);
+
+	if (us > 0) {
+		uint64_t spent = win->io_us;
+
+		if (sched_current == win)
+			spent += c_loop_now() - sched_start;
+		if (spent >= (uint64_t)us)
+			return 0;
+	}
+
+	if (bytes <= 0)
+		return (size_t)-1;
+
+	return (win->io_bytes < (size_t)bytes) ? (size_t)bytes - win->io_bytes : 0;
+}
+
+void win_io_consume(cosh_win_t *win, size_t n)
+{
+	win_io_refill(win);
+	win->io_bytes += n;
+	win->io_held = (win->io_held > n) ? win->io_held - n : 0;
+}
+
+/**
+ * win_io_throttle - @win ran out of budget with @pending bytes still queued
+ * Only bytes not already held back at an earlier stall are counted.
+ */
+void win_io_throttle(cosh_win_t *win, size_t pending)
+{
+	if (pending <= win->io_held)
+		return;
+
+	win->io_throttled += pending - win->io_held;
+	wm.stats.io_throttled += pending - win->io_held;
+	win->io_held = pending;
+}
+
+/**
+ * run_next - Pick the next window to tick, the focused one goes first
+ */
+static int run_next(void)
+{
+	cosh_win_t *f = (wm.focus_idx >= 0) ? wm.stack[wm.focus_idx] : NULL;
+
+	if (f && f->io_queued) {
+		for (int i = 0; i < run_count; i++)
+			if (run_queue[i] == f && win_io_budget(f))
+				return i;
+	}
+
+	for (int i = 0; i < run_count; i++)
+		if (win_io_budget(run_queue[i]))
+			return i;
+
+	return -1;
+}
+
+/**
+ * win_sched_run - Tick ready windows in round robin order
+ * Every window gets the same byte and time budget per frame and a window
+ * that used it up waits for the next frame, so one flooding pty cannot
+ * starve the others. A pass gives up after one window's time budget and
+ * returns to the event loop, so keystrokes are read in between.
+ */
+void win_sched_run(void)
+{
+	int slice = wm.configs.terminal.io_time;
+	uint64_t start = c_loop_now();
+	int visits = run_count;
+
+	while (visits-- > 0) {
+		int i = run_next();
+		cosh_win_t *w;
+		int ret;
+
+		if (i < 0)
+			break;
+
+		w = run_queue[i];
+		run_remove(i);
+
+		sched_current = w;
+		sched_start = c_loop_now();
+		ret = w->tick_cb(w);
+
+		/* tick_cb may have destroyed the window */
+		if (!sched_current)
+			continue;
+
+		w->io_us += c_loop_now() - sched_start;
+		sched_current = NULL;
+
+		/* back of the queue, it has data the others have not been offered */
+		if (ret == LOOP_AGAIN && !w->io_queued)
+			run_push(w);
+
+		if (slice > 0 && c_loop_now() - start >= (uint64_t)slice)
+			break;
+	}
+}
+
+/* any queued window that can still run in this frame */
+static int win_sched_busy(void)
+{
+	return run_next() >= 0;
+}
+
+/**
+ * win_frame_timeout - How long the event loop may sleep
+ * With a redraw pending this is the time left until the frame deadline,
+ * so input and ptys keep draining while the frame is held back.
+ */
+int win_frame_timeout(int idle_timeout)
+{
+	uint64_t now;
+
+	if (win_sched_busy())
+		return 0;
+
+	/* queued windows that used their budget wait for the frame too */
+	if (!win_needs_redraw && !status_dirty && !run_count && !anim_count)
+		return idle_timeout;
+
+	now = c_loop_now();
+	if (now >= next_frame_us)
+		return 0;
+
+	/* round up so we do not wake a hair before the deadline */
+	return (int)((next_frame_us - now + 999) / 1000);
+}
+
+/**
+ * win_frame - Present at most one composited frame per frame deadline
+ */
+void win_frame(void)
+{
+	int pending = win_needs_redraw || status_dirty;
+	uint64_t now;
+
+	if (!pending && !run_count && !anim_count)
+		return;
+
+	now = c_loop_now();
+	if (now < next_frame_us) {
+		frame_held |= pending;
+		return;
+	}
+
+	/* once per frame, however many wakeups it was held back through */
+	if (frame_held && pending)
+		wm.stats.frames_skipped++;
+	frame_held = 0;
+
+	if (anim_count) {
+		win_anim_step(now);
+		pending = 1;
+	}
+
+	if (pending) {
+		win_refresh_all();
+		wm.stats.frames++;
+	}
+
+	/* do not try to catch up on frames we missed while busy */
+	next_frame_us = now + win_frame_interval();
+	win_frame_seq++;	/* refills every window's budget */
+}
@@ -3,12 +3,18 @@
 
 #include "configuration.h"
 #include "util.h"
+#include "Core/loop.h"
 
+#ifndef _XOPEN_SOURCE_EXTENDED
 #define _XOPEN_SOURCE_EXTENDED
+#endif
 #include <curses.h>
 #include <ncurses.h>
 #include <panel.h>
 
+#include "wmcolor.h"
+#include "wmcomp.h"
+
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +41,10 @@ typedef enum {
 	WIN_OPT_TICK = 8,
 	WIN_OPT_RESIZE = 9,
 	WIN_OPT_CURSOR = 10,
+	WIN_OPT_POLLFD = 11,	/* fd that drives tick_cb */
+	WIN_OPT_TIMER = 12,	/* period in ms (0 stops it), timer_fn */
+	WIN_OPT_MODAL = 13,	/* modal_fn, data: capture input until closed */
+	WIN_OPT_RENDER_RECT = 14,	/* render_rect_fn, repaint a dirty rect */
 } win_opt_t;
 
 typedef enum {
@@ -42,7 +52,8 @@ typedef enum {
 	WIN_MOUSE_SCROLL_UP = 0x2001,
 	WIN_MOUSE_SCROLL_DOWN = 0x2002,
 	WIN_MOUSE_SCROLL_LEFT = 0x2003,
-	WIN_MOUSE_SCROLL_RIGHT = 0x2004
+	WIN_MOUSE_SCROLL_RIGHT = 0x2004,
+	WIN_KEY_FIND = 0x2005	/* MOD + find key, apps may search their content */
 } win_seq_t;
 
 typedef enum {
@@ -72,10 +83,31 @@ typedef enum {
 struct cosh_win;
 
 typedef void (*render_fn)(struct cosh_win * win);
+
+/* everything win_render_frame draws depends on */
+typedef struct {
+	int valid;		/* cleared by werase */
+	int focused, dragging, border, flash, locked;
+	int color_pair;
+	int w, h;
+	int scroll_cur, scroll_max;
+	char title[64];
+} win_frame_state_t;
+
+/* cells of a window's viewport, row 0 col 0 is the first content cell */
+typedef struct {
+	int y, x, h, w;
+} win_rect_t;
+
+typedef void (*render_rect_fn)(struct cosh_win * win, win_rect_t rect);
 typedef void (*destroy_fn)(void *priv);
 typedef void (*input_fn)(struct cosh_win * win, int ch, MEVENT * ev);
 typedef void (*resize_fn)(struct cosh_win * win, int new_h, int new_w);
-typedef void (*tick_fn)(struct cosh_win * win);
+typedef int (*tick_fn)(struct cosh_win * win);	/* LOOP_AGAIN stays queued */
+typedef void (*modal_fn)(int result, void *data);	/* runs after the destroy */
+
+#define WIN_MODAL_CANCEL	(-1)	/* closed without win_modal_done */
+typedef void (*timer_fn)(struct cosh_win * win);
 
 typedef struct {
 	int is_dragging;
@@ -93,18 +125,35 @@ typedef struct cosh_win {
 	int vw, vh;
 	int rx, ry, rw, rh;	/* Restoration coordinates */
 	int active;
-	int dirty;
+	int dirty;		/* werase and render everything */
+	win_rect_t dirty_rect;	/* win_mark_dirty_rect, empty when h is 0 */
+	int vis_y0, vis_y1;	/* rows not hidden by windows above, window coords */
+	int stale;		/* rows outside vis_y0..vis_y1 were not repainted */
+	win_frame_state_t frame;	/* last drawn border and title bar */
 	int color_pair;
 	int flags;
 	int fg, bg;		/* Cached colors */
 
 	int poll_fd;
+	c_watch_t *watch;	/* event loop registration of poll_fd */
+	c_watch_t *watches[WIN_WATCH_MAX];	/* extra fds from win_watch */
+	c_watch_t *timer;	/* WIN_OPT_TIMER */
+
+	/* tick scheduler, budgets reset every frame */
+	int io_queued;		/* on the run queue */
+	unsigned long io_seq;	/* frame the budgets below belong to */
+	size_t io_bytes;	/* consumed this frame */
+	uint64_t io_us;		/* spent in tick_cb this frame */
+	unsigned long io_throttled;	/* bytes left pending when a budget ran out */
+	size_t io_held;		/* of those, not consumed yet */
 
 	int scroll_max;
 	int scroll_cur;
 
 	cosh_win_drag_state drag_state;
 
+	int flash;		/* frame drawn reversed, set by animations */
+
 	int show_cursor;
 	int cursor_y, cursor_x;
 
@@ -112,17 +161,46 @@ typedef struct cosh_win {
 	void *priv;
 	destroy_fn destroy_cb;
 	render_fn render_cb;
+	render_rect_fn render_rect_cb;	/* optional, no werase before it */
 	input_fn input_cb;
 	resize_fn resize_cb;
 	win_seq_t last_seq;
 	tick_fn tick_cb;
+	timer_fn timer_cb;
+
+	/* WIN_OPT_MODAL */
+	modal_fn modal_cb;
+	void *modal_data;
+	int modal_result;
+	struct cosh_win *modal_prev;	/* modal underneath this one */
 } cosh_win_t;
 
+/* animation keyframe, offsets are from the window's resting place */
+typedef struct {
+	int at_ms;		/* since the animation started */
+	int dy, dx;
+	int flash;
+} win_keyframe_t;
+
+#define WIN_ANIM_LERP	0x01	/* interpolate offsets between keyframes */
+
 /* config management */
 typedef struct {
 	int refresh_rate;
+	int max_fps;		/* <= 0 means uncapped */
+	int compositor;		/* WIN_COMP_* */
+	int sync_update;	/* DEC 2026 framing, < 0 asks terminfo */
 } cfg_desktop_env_t;
 
+typedef struct {
+	int threaded_io;	/* 0 inline, 1 reader thread, 2 parser thread */
+	int io_budget;		/* bytes parsed per terminal per frame */
+	int io_time;		/* microseconds parsed per terminal per frame */
+	int scrollback;		/* lines kept, 0 is no limit */
+	int scrollback_kb;	/* memory they may take, 0 is no limit */
+	int scrollback_spill;	/* lines past those limits go to the workdir */
+} cfg_terminal_t;
+
 typedef struct {
 	int modifier;
 	char win_mv_up[8];
@@ -130,6 +208,7 @@ typedef struct {
 	char win_mv_right[8];
 	char win_mv_left[8];
 	char tog_fullscr[8];
+	char find[8];
 } cfg_keys_t;
 
 typedef struct {
@@ -147,50 +226,77 @@ typedef struct {
 
 typedef struct {
 	int show_border;	//bool
+	int show_stats;		//bool, counters in the statusbar
 
 	cfg_desktop_env_t desktop;
+	cfg_terminal_t terminal;
 	cfg_keys_t keys;
 	cfg_colorscheme_t colorscheme;
 } cosh_wm_config_t;
 
+/* frame and scheduler counters */
+typedef struct {
+	unsigned long frames;	/* composited frames presented */
+	unsigned long frames_skipped;	/* frames held back to merge redraws */
+	unsigned long io_throttled;	/* sum of every window's io_throttled */
+} cosh_wm_stats_t;
+
 /* global stat */
 typedef struct {
 	cosh_win_t *stack[WIN_MAX];
 	cosh_win_t *drag_win;	/* Pointer to a window that dragged */
+	cosh_win_t *modal;	/* receives all input while set */
 	int count;
 	int focus_idx;
 
 	cosh_wm_config_t configs;
+	cosh_wm_stats_t stats;
 } cosh_wm_t;
 
 extern cosh_wm_t wm;
 extern win_buffreq_t win_buffer_request;
 extern int win_needs_redraw;
 extern int win_force_full;
-extern volatile sig_atomic_t terminal_resized;
+extern unsigned long win_frame_seq;
 
 void wm_init(void);
 
 cosh_win_t *win_create(int h, int w, int flags);
 void win_setopt(cosh_win_t * win, win_opt_t opt, ...);
+c_watch_t *win_watch(cosh_win_t * win, int fd, uint32_t events, watch_fn cb);
+void win_unwatch(cosh_win_t * win, c_watch_t * wt);
 
 void wm_cleanup_before_exit(void);
 void win_destroy(cosh_win_t * win);
 void win_destroy_focused(void);
+void win_modal_done(cosh_win_t * win, int result);
 void win_raise(int idx);
 void win_vibrate(void);
+int win_animate(cosh_win_t * win, const win_keyframe_t * kf, int n, int flags);
+void win_anim_cancel(cosh_win_t * win);
 void win_toggle_fullscreen(cosh_win_t * win);
+void win_toggle_stats(void);
 void win_resize_focused(int dh, int dw);
 void win_handle_resize(void);
 void win_ding(void);
 void win_move_focused(int dy, int dx);
 void win_handle_mouse(void);
 void win_refresh_all(void);
+int win_frame_timeout(int idle_timeout);
+void win_frame(void);
+void win_sched_run(void);
+size_t win_io_budget(cosh_win_t * win);
+void win_io_consume(cosh_win_t * win, size_t n);
+void win_io_throttle(cosh_win_t * win, size_t pending);
 
 void win_printf(cosh_win_t * win, const char *fmt, ...);
 void win_attron(cosh_win_t * win, int pair);
 void win_attroff(cosh_win_t * win, int pair);
 void win_move_cursor(cosh_win_t * win, int y, int x);
 void win_clear(cosh_win_t * win);
+void win_input(cosh_win_t * win, int ch, MEVENT * ev);
+void win_mark_dirty_rect(cosh_win_t * win, int y, int x, int h, int w);
+void win_visible_rows(cosh_win_t * win, int *y0, int *y1);
+int win_scroll(cosh_win_t * win, int y, int h, int n);
 
 #endif				/* WMCURSES_H */